@@ -25,16 +25,33 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
 #ifdef HAVE_SYSEXITS_H
 #include <sysexits.h>
 #else
 #define EX_OK     0 /* successful termination */
 #define EX_OSERR 71 /* system error (e.g., can't fork) */
 #define EX_USAGE 64 /* command line usage error */
+#define EX_NOINPUT 66 /* cannot open input */
+#define EX_UNAVAILABLE 69 /* service unavailable */
+#define EX_SOFTWARE 70 /* internal software error */
 #endif
 #include <sys/time.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <ctype.h>
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#endif
 
 #ifdef __APPLE__
 #include <PCSC/wintypes.h>
@@ -45,11 +62,56 @@
 
 #define TIMEOUT 3600*1000	/* 1 hour timeout */
 
+#define ANALYSIS_WORKERS 4	/* default number of parallel ATR analyses */
+
 
 #ifndef SCARD_E_NO_READERS_AVAILABLE
 #define SCARD_E_NO_READERS_AVAILABLE 0x8010002E
 #endif
 
+/* reader attributes and features (from reader.h of pcsc-lite, not
+ * available on every platform) */
+#ifndef SCARD_ATTR_VALUE
+#define SCARD_ATTR_VALUE(Class, Tag) ((((DWORD)(Class)) << 16) | ((DWORD)(Tag)))
+#define SCARD_CLASS_VENDOR_INFO 1
+#define SCARD_CLASS_PROTOCOL 3
+#define SCARD_CLASS_VENDOR_DEFINED 7
+#define SCARD_CLASS_IFD_PROTOCOL 8
+#endif
+#ifndef SCARD_ATTR_VENDOR_NAME
+#define SCARD_ATTR_VENDOR_NAME SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_INFO, 0x0100)
+#define SCARD_ATTR_VENDOR_IFD_TYPE SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_INFO, 0x0101)
+#define SCARD_ATTR_VENDOR_IFD_VERSION SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_INFO, 0x0102)
+#define SCARD_ATTR_DEFAULT_CLK SCARD_ATTR_VALUE(SCARD_CLASS_PROTOCOL, 0x0121)
+#define SCARD_ATTR_MAX_CLK SCARD_ATTR_VALUE(SCARD_CLASS_PROTOCOL, 0x0122)
+#define SCARD_ATTR_DEFAULT_DATA_RATE SCARD_ATTR_VALUE(SCARD_CLASS_PROTOCOL, 0x0123)
+#define SCARD_ATTR_MAX_DATA_RATE SCARD_ATTR_VALUE(SCARD_CLASS_PROTOCOL, 0x0124)
+#define SCARD_ATTR_MAX_IFSD SCARD_ATTR_VALUE(SCARD_CLASS_PROTOCOL, 0x0125)
+#define SCARD_ATTR_CURRENT_CLK SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x0202)
+#define SCARD_ATTR_CURRENT_F SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x0203)
+#define SCARD_ATTR_CURRENT_D SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x0204)
+#define SCARD_ATTR_CURRENT_IFSC SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x0207)
+#define SCARD_ATTR_CURRENT_IFSD SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x0208)
+#define SCARD_ATTR_CURRENT_BWT SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x0209)
+#define SCARD_ATTR_CURRENT_CWT SCARD_ATTR_VALUE(SCARD_CLASS_IFD_PROTOCOL, 0x020a)
+#endif
+#ifndef SCARD_ATTR_MAXINPUT
+#define SCARD_ATTR_MAXINPUT SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0xA007)
+#endif
+#ifndef SCARD_CTL_CODE
+#define SCARD_CTL_CODE(code) (0x42000000 + (code))
+#endif
+#ifndef CM_IOCTL_GET_FEATURE_REQUEST
+#define CM_IOCTL_GET_FEATURE_REQUEST SCARD_CTL_CODE(3400)
+#endif
+#define FEATURE_GET_TLV_PROPERTIES_TAG 0x12
+#define PART10_PROPERTY_bMinPINSize 6
+#define PART10_PROPERTY_bMaxPINSize 7
+#define PART10_PROPERTY_sFirmwareID 8
+#define PART10_PROPERTY_dwMaxAPDUDataSize 10
+#define PART10_PROPERTY_wIdVendor 11
+#define PART10_PROPERTY_wIdProduct 12
+
 #ifdef WIN32
 const char *pcsc_stringify_error(DWORD rv)
 {
@@ -87,16 +149,33 @@ do { \
 
 static void usage(const char *pname)
 {
-	printf("%s usage:\n\n%s [ -h | -V | -n | -r | -c | -s | -t secs | -d | -p]\n\n", pname, pname);
+	printf("%s usage:\n\n%s [ -h | -V | -n | -r | -c | -m | -b count | -s | -t secs | -d | -p]\n", pname, pname);
+	printf("\t[-i glob] [-x glob] [-I regex] [-X regex] [-a ATR] [-A file]\n");
+	printf("\t[-D [glob=]ms] [-w file] [-F] [-N clients] [-U secs] [-j workers]\n\n");
 	printf("  -h : this help\n");
 	printf("  -V : print version number\n");
 	printf("  -n : no ATR analysis\n");
 	printf("  -r : only lists readers\n");
 	printf("  -c : only lists cards\n");
+	printf("  -m : machine readable snapshot of readers and cards\n");
+	printf("  -b count : benchmark count snapshots\n");
 	printf("  -s : stress mode\n");
 	printf("  -t secs : quit after secs seconds\n");
 	printf("  -d : debug mode\n");
 	printf("  -p : force use of PnP mechanism\n");
+	printf("  -i glob : only use readers matching glob\n");
+	printf("  -x glob : do not use readers matching glob\n");
+	printf("  -I regex : only use readers matching regex\n");
+	printf("  -X regex : do not use readers matching regex\n");
+	printf("  -a ATR : only report cards matching ATR (smartcard_list.txt syntax)\n");
+	printf("  -A file : only report cards matching an ATR listed in file\n");
+	printf("  -D [glob=]ms : debounce window for (matching) readers\n");
+	printf("  -w file : append the APDUs sent in stress mode to the capture file\n");
+	printf("  -F : probe and display the reader capabilities\n");
+	printf("  -N clients : benchmark the notification of clients waiting for events\n");
+	printf("  -U secs : print the reader statistics every secs seconds (0: on SIGUSR1 only)\n");
+	printf("  -j workers : number of ATR analyses run in parallel (default %d)\n",
+		ANALYSIS_WORKERS);
 	printf("\n");
 }
 
@@ -113,6 +192,20 @@ const char *cnl = "";
 time_t start_time;
 _Atomic bool Interrupted = false;
 
+static const char State_names[][sizeof "UNAVAILABLE"] = {
+	"IGNORE",		/* 0x0001 */
+	"CHANGED",		/* 0x0002 */
+	"UNKNOWN",		/* 0x0004 */
+	"UNAVAILABLE",	/* 0x0008 */
+	"EMPTY",		/* 0x0010 */
+	"PRESENT",		/* 0x0020 */
+	"ATRMATCH",		/* 0x0040 */
+	"EXCLUSIVE",	/* 0x0080 */
+	"INUSE",		/* 0x0100 */
+	"MUTE",			/* 0x0200 */
+	"UNPOWERED"		/* 0x0400 */
+};
+
 typedef struct
 {
 	const char *pname;
@@ -121,13 +214,80 @@ typedef struct
 	bool print_version;
 	bool only_list_readers;
 	bool only_list_cards;
+	bool snapshot;
+	int benchmark;
+	int fanout;	/* number of clients of the fan-out benchmark */
+	bool stats;	/* print the reader statistics */
+	int stats_interval;	/* in seconds, 0 for SIGUSR1 only */
 	bool debug;
 	bool pnp;
+	bool debounce;
+	const char *capture;	/* APDU capture file */
+	bool probe;
+	int workers;	/* number of parallel ATR analyses */
 	long maxtime; // in seconds
 } options_t;
 
 static options_t Options;
 
+/* reader name filter given by -i, -x, -I or -X */
+typedef struct
+{
+	const char *pattern;
+	bool include;
+	bool is_regex;
+#ifdef HAVE_REGEX_H
+	regex_t re;
+#endif
+} reader_filter_t;
+
+static reader_filter_t *Reader_filters = NULL;
+static int Nb_reader_filters = 0;
+
+/* ATR pattern using the smartcard_list.txt syntax */
+typedef struct
+{
+	char *pattern;
+	bool literal;
+#ifdef HAVE_REGEX_H
+	regex_t re;
+#endif
+} atr_pattern_t;
+
+static atr_pattern_t *Atr_filters = NULL;
+static int Nb_atr_filters = 0;
+
+/* debounce window given by -D glob=ms */
+typedef struct
+{
+	const char *pattern;
+	int ms;
+} debounce_window_t;
+
+static debounce_window_t *Debounce_windows = NULL;
+static int Nb_debounce_windows = 0;
+static int Default_debounce_ms = 0;
+
+/* per reader data, in the same order as rgReaderStates_t[] */
+typedef struct
+{
+	bool card_filtered;	/* the card does not match the ATR filters */
+	bool reported;	/* the current event of the reader is printed */
+	bool is_pnp;	/* the \\?PnP?\Notification special reader */
+
+	/* debounce */
+	int debounce_ms;
+	bool pending;	/* transitions are being collapsed */
+	long long deadline;	/* end of the debounce window in µs */
+	int transitions;	/* during the current window */
+	int suppressed;	/* transitions not reported yet */
+	DWORD reported_state;
+	DWORD reported_cbAtr;
+	BYTE reported_atr[MAX_ATR_SIZE];
+
+	struct analysis_job *analysis;	/* ATR analysis done by a worker */
+} reader_data_t;
+
 SCARDCONTEXT hContext;
 
 pthread_mutex_t spinner_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -179,6 +339,19 @@ static void initialize_terminal(void)
 }
 /* There should be no \033 beyond this line! */
 
+static long long monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long monotonic_us(void)
+{
+	return monotonic_ns() / 1000;
+}
+
 static bool should_exit(void)
 {
 	if (Options.maxtime)
@@ -194,7 +367,36 @@ static bool should_exit(void)
 	return false;
 }
 
+_Atomic bool Stats_requested = false;	/* SIGUSR1 */
+static _Atomic long long Next_stats_us = 0;
+
+/* is it time to print the reader statistics? */
+static bool stats_due(void)
+{
+	if (Stats_requested)
+		return true;
+
+	return Options.stats_interval && monotonic_us() >= Next_stats_us;
+}
+
+/* SCardGetStatusChange() cancelled by the spinner thread to print the
+ * statistics is handled as a timeout without any change
+ * The statistics may be already printed if the main thread was not
+ * waiting when the spinner thread cancelled. */
+static LONG stats_wakeup(LONG rv, SCARD_READERSTATE states[], int count)
+{
+	if (SCARD_E_CANCELLED == rv && ! should_exit())
+	{
+		for (int i=0; i<count; i++)
+			states[i].dwEventState &= ~SCARD_STATE_CHANGED;
+		rv = SCARD_E_TIMEOUT;
+	}
+
+	return rv;
+}
+
 _Atomic bool Spin_is_running = false;
+static bool Spin_exit = false;	/* end of the spinner thread */
 
 static void spin_start(void)
 {
@@ -223,6 +425,32 @@ static void spin_stop(void)
 	pthread_cond_signal(&spinner_cond);
 }
 
+static bool Prompted = false;	/* the prompt is the last line printed */
+
+/* print the prompt and wait with the spinner, unless already done */
+static void prompt_start(void)
+{
+	if (Prompted)
+		return;
+
+	printf("%sInsert or remove a card or a reader...%s ", red, color_end);
+	fflush(stdout);
+
+	spin_start();
+	Prompted = true;
+}
+
+/* end the prompt line before printing something else */
+static void prompt_end(void)
+{
+	if (! Prompted)
+		return;
+
+	spin_stop();
+	printf("\n");
+	Prompted = false;
+}
+
 static void *spin_update(void *p)
 {
 	char patterns[] = {'-', '\\', '|', '/'};
@@ -237,7 +465,14 @@ static void *spin_update(void *p)
 
 again:
 	/* wait until spinning starts */
-	pthread_cond_wait(&spinner_cond, &spinner_mutex);
+	while (! Spin_is_running && ! Spin_exit)
+		pthread_cond_wait(&spinner_cond, &spinner_mutex);
+
+	if (Spin_exit)
+	{
+		pthread_mutex_unlock(&spinner_mutex);
+		pthread_exit(NULL);
+	}
 
 	printf(".  (use Ctrl-C to exit)");
 	for (int i=0; i<7; i++)
@@ -268,13 +503,36 @@ again:
 		}
 
 		pthread_cond_timedwait(&spinner_cond, &spinner_mutex, &ts);
-	} while (Spin_is_running && ! should_exit());
+	} while (Spin_is_running && ! Spin_exit && ! should_exit()
+		&& ! stats_due());
+
+	if (Spin_is_running && ! Spin_exit && ! should_exit())
+	{
+		/* wake up the main thread to print the statistics and wait
+		 * until they are printed */
+		while (Spin_is_running && ! Spin_exit && stats_due()
+			&& ! should_exit())
+		{
+			SCardCancel(hContext);
+
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&spinner_cond, &spinner_mutex, &ts);
+		}
+	}
 
-	if (should_exit())
+	/* the main thread may be between two SCardGetStatusChange() calls
+	 * and miss the cancellation: cancel until it stops waiting */
+	while (Spin_is_running && ! Spin_exit && should_exit())
 	{
 		SCardCancel(hContext);
-		pthread_mutex_unlock(&spinner_mutex);
-		pthread_exit(NULL);
+
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec > 1000 * 1000 * 1000)
+		{
+			ts.tv_nsec -= 1000* 1000 * 1000;
+			ts.tv_sec += 1;
+		}
+		pthread_cond_timedwait(&spinner_cond, &spinner_mutex, &ts);
 	}
 
 	goto again;
@@ -288,9 +546,20 @@ static void user_interrupt_signal_handler(int signal)
 	Interrupted = true;
 }
 
+#ifdef SIGUSR1
+static void stats_signal_handler(int signal)
+{
+	(void)signal;
+	Stats_requested = true;
+}
+#endif
+
 static void initialize_signal_handlers(void)
 {
 	signal(SIGINT, user_interrupt_signal_handler);
+#ifdef SIGUSR1
+	signal(SIGUSR1, stats_signal_handler);
+#endif
 }
 
 
@@ -307,12 +576,21 @@ static void initialize_options(options_t *options, const char *pname)
 	options->print_version = false;
 	options->only_list_readers = false;
 	options->only_list_cards = false;
+	options->snapshot = false;
+	options->benchmark = 0;
+	options->fanout = 0;
+	options->stats = false;
+	options->stats_interval = 0;
 	options->debug = false;
 	options->pnp = false;
+	options->debounce = false;
+	options->capture = getenv("PCSC_APDU_CAPTURE");
+	options->probe = false;
+	options->workers = ANALYSIS_WORKERS;
 	options->maxtime = 0;
 }
 
-#define OPTIONS "Vhrcst:dpn"
+#define OPTIONS "Vhrcmb:st:dpni:x:I:X:a:A:D:w:FN:U:j:"
 
 static void print_version(void)
 {
@@ -321,6 +599,310 @@ static void print_version(void)
 			PACKAGE_VERSION);
 }
 
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (NULL == ptr)
+	{
+		fprintf(stderr, "%s: realloc: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+	return ptr;
+}
+
+static char *append_line(char *str, const char *line)
+{
+	size_t len = str ? strlen(str) : 0;
+
+	str = xrealloc(str, len + strlen(line) + 2);
+	sprintf(str + len, "%s\n", line);
+
+	return str;
+}
+
+static void add_reader_filter(const char *pattern, bool include, bool is_regex)
+{
+	reader_filter_t *filter;
+
+	Reader_filters = xrealloc(Reader_filters,
+		(Nb_reader_filters + 1) * sizeof *Reader_filters);
+	filter = &Reader_filters[Nb_reader_filters];
+	filter->pattern = pattern;
+	filter->include = include;
+	filter->is_regex = is_regex;
+
+	if (is_regex)
+	{
+#ifdef HAVE_REGEX_H
+		int err = regcomp(&filter->re, pattern, REG_EXTENDED | REG_NOSUB);
+		if (err)
+		{
+			char buffer[256];
+
+			regerror(err, &filter->re, buffer, sizeof buffer);
+			fprintf(stderr, "%s: invalid regex \"%s\": %s\n", Options.pname,
+				pattern, buffer);
+			exit(EX_USAGE);
+		}
+#else
+		fprintf(stderr, "%s: regex not supported on this platform\n",
+			Options.pname);
+		exit(EX_USAGE);
+#endif
+	}
+
+	Nb_reader_filters++;
+}
+
+/* shell like pattern with * and ? */
+static bool glob_match(const char *pattern, const char *string)
+{
+	for (; *pattern; pattern++, string++)
+	{
+		if ('*' == *pattern)
+		{
+			do
+			{
+				if (glob_match(pattern + 1, string))
+					return true;
+			} while (*string++);
+			return false;
+		}
+
+		if ('\0' == *string)
+			return false;
+
+		if ('?' != *pattern && *pattern != *string)
+			return false;
+	}
+
+	return '\0' == *string;
+}
+
+static bool reader_filter_match(const reader_filter_t *filter,
+	const char *reader)
+{
+#ifdef HAVE_REGEX_H
+	if (filter->is_regex)
+		return 0 == regexec(&filter->re, reader, 0, NULL, 0);
+#endif
+	return glob_match(filter->pattern, reader);
+}
+
+/* should the reader be monitored? */
+static bool reader_selected(const char *reader)
+{
+	bool has_include = false, included = false;
+
+	for (int i=0; i<Nb_reader_filters; i++)
+	{
+		bool match = reader_filter_match(&Reader_filters[i], reader);
+
+		if (Reader_filters[i].include)
+		{
+			has_include = true;
+			if (match)
+				included = true;
+		}
+		else
+			if (match)
+				return false;
+	}
+
+	return !has_include || included;
+}
+
+/* return 0 or the regcomp() error */
+static int atr_pattern_compile(atr_pattern_t *pattern, const char *text)
+{
+	char *p;
+
+	pattern->pattern = strdup(text);
+	if (NULL == pattern->pattern)
+	{
+		fprintf(stderr, "%s: strdup: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+	for (p = pattern->pattern; *p; p++)
+		*p = toupper((unsigned char)*p);
+
+	/* most of the ATRs in smartcard_list.txt do not use a regex */
+	pattern->literal = strspn(pattern->pattern, "0123456789ABCDEF ")
+		== strlen(pattern->pattern);
+
+#ifdef HAVE_REGEX_H
+	if (! pattern->literal)
+	{
+		size_t len = strlen(text) + sizeof "^()$";
+		char *re = xrealloc(NULL, len);
+		int err;
+
+		snprintf(re, len, "^(%s)$", pattern->pattern);
+		err = regcomp(&pattern->re, re, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+		free(re);
+		if (err)
+		{
+			free(pattern->pattern);
+			pattern->pattern = NULL;
+		}
+		return err;
+	}
+#endif
+
+	return 0;
+}
+
+static void atr_pattern_free(atr_pattern_t *pattern)
+{
+#ifdef HAVE_REGEX_H
+	if (! pattern->literal)
+		regfree(&pattern->re);
+#endif
+	free(pattern->pattern);
+	pattern->pattern = NULL;
+}
+
+static void add_atr_filter(const char *pattern)
+{
+	atr_pattern_t *filter;
+	int err;
+
+	Atr_filters = xrealloc(Atr_filters,
+		(Nb_atr_filters + 1) * sizeof *Atr_filters);
+	filter = &Atr_filters[Nb_atr_filters];
+
+	err = atr_pattern_compile(filter, pattern);
+	if (err)
+	{
+#ifdef HAVE_REGEX_H
+		char buffer[256];
+
+		regerror(err, &filter->re, buffer, sizeof buffer);
+		fprintf(stderr, "%s: invalid ATR pattern \"%s\": %s\n",
+			Options.pname, pattern, buffer);
+#endif
+		exit(EX_USAGE);
+	}
+
+	Nb_atr_filters++;
+}
+
+/* read ATR patterns from a file using the smartcard_list.txt format */
+static void add_atr_filters_from_file(const char *filename)
+{
+	char line[1024];
+	FILE *f = fopen(filename, "r");
+
+	if (NULL == f)
+	{
+		fprintf(stderr, "%s: can't open %s: ", Options.pname, filename);
+		perror("");
+		exit(EX_USAGE);
+	}
+
+	while (fgets(line, sizeof line, f))
+	{
+		/* comment, description or empty line */
+		if ('#' == line[0] || '\t' == line[0])
+			continue;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if ('\0' == line[0])
+			continue;
+
+		add_atr_filter(line);
+	}
+	fclose(f);
+}
+
+static bool atr_pattern_match(const atr_pattern_t *pattern, const char *atr)
+{
+	if (pattern->literal)
+		return 0 == strcmp(pattern->pattern, atr);
+
+#ifdef HAVE_REGEX_H
+	return 0 == regexec(&pattern->re, atr, 0, NULL, 0);
+#else
+	/* no regex support: only handle the . wildcard */
+	const char *p = pattern->pattern;
+	for (; *p && *atr; p++, atr++)
+		if ('.' != *p && *p != *atr)
+			return false;
+	return *p == *atr;
+#endif
+}
+
+/* should the card be reported? */
+static bool atr_selected(const char *atr)
+{
+	if (0 == Nb_atr_filters)
+		return true;
+
+	for (int i=0; i<Nb_atr_filters; i++)
+		if (atr_pattern_match(&Atr_filters[i], atr))
+			return true;
+
+	return false;
+}
+
+/* -D ms or -D glob=ms */
+static void add_debounce_window(char *arg)
+{
+	char *equal = strrchr(arg, '=');
+	char *end;
+	long ms = strtol(equal ? equal + 1 : arg, &end, 10);
+
+	if (*end != '\0' || end == (equal ? equal + 1 : arg) || ms < 0)
+	{
+		fprintf(stderr, "%s: invalid debounce window: %s\n", Options.pname, arg);
+		exit(EX_USAGE);
+	}
+
+	if (NULL == equal)
+	{
+		Default_debounce_ms = ms;
+		return;
+	}
+
+	*equal = '\0';
+	Debounce_windows = xrealloc(Debounce_windows,
+		(Nb_debounce_windows + 1) * sizeof *Debounce_windows);
+	Debounce_windows[Nb_debounce_windows].pattern = arg;
+	Debounce_windows[Nb_debounce_windows].ms = ms;
+	Nb_debounce_windows++;
+}
+
+static int debounce_window(const char *reader)
+{
+	for (int i=0; i<Nb_debounce_windows; i++)
+		if (glob_match(Debounce_windows[i].pattern, reader))
+			return Debounce_windows[i].ms;
+
+	return Default_debounce_ms;
+}
+
+static void free_filters(void)
+{
+#ifdef HAVE_REGEX_H
+	for (int i=0; i<Nb_reader_filters; i++)
+		if (Reader_filters[i].is_regex)
+			regfree(&Reader_filters[i].re);
+#endif
+	free(Reader_filters);
+	Reader_filters = NULL;
+	Nb_reader_filters = 0;
+
+	for (int i=0; i<Nb_atr_filters; i++)
+		atr_pattern_free(&Atr_filters[i]);
+	free(Atr_filters);
+	Atr_filters = NULL;
+	Nb_atr_filters = 0;
+
+	free(Debounce_windows);
+	Debounce_windows = NULL;
+	Nb_debounce_windows = 0;
+}
+
 static int parse_options(int argc, char *argv[], options_t *options)
 {
 	const char *pname = argv[0];
@@ -348,172 +930,2633 @@ static int parse_options(int argc, char *argv[], options_t *options)
 				options->analyse_atr = false;
 				break;
 
+			case 'm':
+				options->snapshot = true;
+				break;
+
+			case 'b':
+				options->benchmark = atoi(optarg);
+				if (options->benchmark <= 0)
+				{
+					fprintf(stderr, "%s error: invalid count: %s\n", pname, optarg);
+					exit(EX_USAGE);
+				}
+				break;
+
 			case 's':
 				options->stress_card = true;
 				break;
 
-			case 't':
-				options->maxtime = atol(optarg);
-				break;
+			case 't':
+				options->maxtime = atol(optarg);
+				break;
+
+			case 'p':
+				options->pnp = true;
+				break;
+
+			case 'h':
+				usage(pname);
+				exit(EX_OK);
+
+			case 'd':
+				options->debug = true;
+				break;
+
+			case 'i':
+				add_reader_filter(optarg, true, false);
+				break;
+
+			case 'x':
+				add_reader_filter(optarg, false, false);
+				break;
+
+			case 'I':
+				add_reader_filter(optarg, true, true);
+				break;
+
+			case 'X':
+				add_reader_filter(optarg, false, true);
+				break;
+
+			case 'a':
+				add_atr_filter(optarg);
+				break;
+
+			case 'A':
+				add_atr_filters_from_file(optarg);
+				break;
+
+			case 'D':
+				add_debounce_window(optarg);
+				options->debounce = true;
+				break;
+
+			case 'w':
+				options->capture = optarg;
+				break;
+
+			case 'F':
+				options->probe = true;
+				break;
+
+			case 'U':
+				options->stats = true;
+				options->stats_interval = atoi(optarg);
+				if (options->stats_interval < 0)
+				{
+					fprintf(stderr, "%s error: invalid interval: %s\n", pname, optarg);
+					exit(EX_USAGE);
+				}
+				break;
+
+			case 'j':
+				options->workers = atoi(optarg);
+				if (options->workers <= 0)
+				{
+					fprintf(stderr, "%s error: invalid number of workers: %s\n", pname, optarg);
+					exit(EX_USAGE);
+				}
+				break;
+
+			case 'N':
+				options->fanout = atoi(optarg);
+				if (options->fanout <= 0)
+				{
+					fprintf(stderr, "%s error: invalid number of clients: %s\n", pname, optarg);
+					exit(EX_USAGE);
+				}
+				break;
+
+			default:
+				usage(pname);
+				exit(EX_USAGE);
+		}
+	}
+	if (argc - optind != 0)
+	{
+		fprintf(stderr, "%s error: superfluous arguments: %s\n", pname, argv[optind]);
+		usage(pname);
+		exit(EX_USAGE);
+	}
+	return EX_OK;
+}
+
+/* APDU capture file, see apdu_summary(1) for the format.
+ * Each record is written using only one write(2) on a file opened with
+ * O_APPEND so the records of concurrent processes are not mixed */
+#define CAPTURE_MAGIC "PCSCAPDU"
+#define CAPTURE_VERSION 2
+#define CAPTURE_SESSION 1
+#define CAPTURE_READER 2
+#define CAPTURE_APDU 3
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static int Capture = -1;
+static unsigned long long Capture_session;	/* session ID */
+static unsigned char *Capture_buffer = NULL;	/* record being built */
+static size_t Capture_length = 0, Capture_size = 0;
+static char **Capture_readers = NULL;	/* copies of the reader names */
+static int Nb_capture_readers = 0;
+
+static unsigned char *put_u16(unsigned char *p, unsigned int value)
+{
+	*p++ = value >> 8;
+	*p++ = value;
+	return p;
+}
+
+static unsigned char *put_u32(unsigned char *p, unsigned long value)
+{
+	p = put_u16(p, (value >> 16) & 0xFFFF);
+	return put_u16(p, value & 0xFFFF);
+}
+
+static unsigned char *put_u64(unsigned char *p, unsigned long long value)
+{
+	p = put_u32(p, (value >> 32) & 0xFFFFFFFF);
+	return put_u32(p, value & 0xFFFFFFFF);
+}
+
+static void capture_write(const void *data, size_t len)
+{
+	if (Capture_length + len > Capture_size)
+	{
+		Capture_size = Capture_length + len + 1024;
+		Capture_buffer = xrealloc(Capture_buffer, Capture_size);
+	}
+	if (len)
+		memcpy(Capture_buffer + Capture_length, data, len);
+	Capture_length += len;
+}
+
+/* record: type (1 byte), length of the payload (4 bytes), payload
+ * the payload starts with the session ID (8 bytes) */
+static void capture_record(int type, size_t len)
+{
+	unsigned char header[5+8];
+
+	header[0] = type;
+	put_u64(put_u32(header + 1, 8 + len), Capture_session);
+	Capture_length = 0;
+	capture_write(header, sizeof header);
+}
+
+static void capture_close(void)
+{
+	if (Capture < 0)
+		return;
+
+	if (close(Capture))
+		perror(Options.capture);
+	Capture = -1;
+
+	free(Capture_buffer);
+	Capture_buffer = NULL;
+	Capture_length = Capture_size = 0;
+
+	for (int i=0; i<Nb_capture_readers; i++)
+		free(Capture_readers[i]);
+	free(Capture_readers);
+	Capture_readers = NULL;
+	Nb_capture_readers = 0;
+}
+
+/* write the complete record at the end of the file */
+static void capture_flush(void)
+{
+	/* already failed */
+	if (Capture < 0)
+		return;
+
+	if (write(Capture, Capture_buffer, Capture_length)
+		!= (ssize_t)Capture_length)
+	{
+		perror(Options.capture);
+		capture_close();
+		Options.capture = NULL;
+	}
+}
+
+static void capture_header(unsigned char *header)
+{
+	unsigned char *p;
+
+	memcpy(header, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC - 1);
+	p = put_u16(header + sizeof CAPTURE_MAGIC - 1, CAPTURE_VERSION);
+	put_u16(p, 0);
+}
+
+#ifndef WIN32
+/* create a new capture file with its header
+ * the header is written in a temporary file then link(2)ed so another
+ * process never appends a record to a file without header */
+static void capture_create(const char *file)
+{
+	unsigned char header[sizeof CAPTURE_MAGIC - 1 + 4];
+	size_t len = strlen(file) + 16;
+	char *tmp = xrealloc(NULL, len);
+	bool ok;
+	int fd;
+
+	snprintf(tmp, len, "%s.%d", file, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+	{
+		/* the file is then created by capture_open() */
+		free(tmp);
+		return;
+	}
+
+	capture_header(header);
+	ok = write(fd, header, sizeof header) == (ssize_t)sizeof header;
+	if (close(fd))
+		ok = false;
+	/* EEXIST: created by another process in the meantime */
+	if (ok)
+		(void)link(tmp, file);
+	unlink(tmp);
+	free(tmp);
+}
+#endif
+
+/* open the capture file in append mode and start a new session
+ * return false if the capture is disabled or failed */
+static bool capture_open(void)
+{
+	unsigned char session[12], *p;
+	struct timeval tv;
+
+	if (Capture >= 0)
+		return true;
+
+	if (NULL == Options.capture || '\0' == Options.capture[0])
+		return false;
+
+#ifndef WIN32
+	if (access(Options.capture, F_OK))
+		capture_create(Options.capture);
+#endif
+
+	Capture = open(Options.capture, O_WRONLY | O_APPEND | O_CREAT | O_BINARY,
+		0666);
+	if (Capture < 0)
+	{
+		perror(Options.capture);
+		Options.capture = NULL;
+		return false;
+	}
+
+	/* file header for a new file not created by capture_create() */
+	if (0 == lseek(Capture, 0, SEEK_END))
+	{
+		unsigned char header[sizeof CAPTURE_MAGIC - 1 + 4];
+
+		capture_header(header);
+		if (write(Capture, header, sizeof header) != (ssize_t)sizeof header)
+		{
+			perror(Options.capture);
+			capture_close();
+			Options.capture = NULL;
+			return false;
+		}
+	}
+
+	/* session: wall clock time in µs, pid, program name
+	 * the session ID is the pid and the low 32 bits of the time so
+	 * the sessions of concurrent processes can be separated
+	 * reader IDs are only valid inside a session */
+	gettimeofday(&tv, NULL);
+	Capture_session = (unsigned long long)getpid() << 32
+		| ((tv.tv_sec * 1000000ULL + tv.tv_usec) & 0xFFFFFFFF);
+	p = put_u64(session, tv.tv_sec * 1000000ULL + tv.tv_usec);
+	put_u32(p, getpid());
+	capture_record(CAPTURE_SESSION, sizeof session + strlen("pcsc_scan"));
+	capture_write(session, sizeof session);
+	capture_write("pcsc_scan", strlen("pcsc_scan"));
+	capture_flush();
+
+	return Capture >= 0;
+}
+
+/* return the ID of the reader in the capture session
+ * the name is recorded the first time */
+static int capture_reader_id(const char *reader)
+{
+	unsigned char payload[2];
+	int id;
+
+	for (id=0; id<Nb_capture_readers; id++)
+		if (0 == strcmp(reader, Capture_readers[id]))
+			return id;
+
+	Capture_readers = xrealloc(Capture_readers,
+		(Nb_capture_readers+1) * sizeof *Capture_readers);
+	/* the reader names are freed when the list of readers is reloaded */
+	Capture_readers[Nb_capture_readers] = strdup(reader);
+	if (NULL == Capture_readers[Nb_capture_readers])
+	{
+		fprintf(stderr, "%s: strdup: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	put_u16(payload, id);
+	capture_record(CAPTURE_READER, sizeof payload + strlen(reader));
+	capture_write(payload, sizeof payload);
+	capture_write(reader, strlen(reader));
+	capture_flush();
+
+	return Nb_capture_readers++;
+}
+
+/* APDU: reader ID (2 bytes), protocol (1 byte: 0, 1 or 255 for other),
+ * reserved (1 byte), PC/SC return code (4 bytes), start and end
+ * monotonic time in ns (8 bytes each), SW (2 bytes), command length
+ * (2 bytes), command, response length without SW (2 bytes), response */
+static void capture_apdu(int reader_id, DWORD protocol, LONG rv,
+	long long start, long long end, const BYTE *cmd, DWORD cmd_len,
+	const BYTE *resp, DWORD resp_len)
+{
+	unsigned char payload[2+1+1+4+8+8+2+2], *p;
+	unsigned char length[2];
+	unsigned int sw = 0;
+
+	if (SCARD_S_SUCCESS == rv && resp_len >= 2)
+	{
+		resp_len -= 2;
+		sw = resp[resp_len] << 8 | resp[resp_len+1];
+	}
+	else
+		resp_len = 0;
+
+	p = put_u16(payload, reader_id);
+	*p++ = SCARD_PROTOCOL_T0 == protocol ? 0 :
+		SCARD_PROTOCOL_T1 == protocol ? 1 : 255;
+	*p++ = 0;
+	p = put_u32(p, rv);
+	p = put_u64(p, start);
+	p = put_u64(p, end);
+	p = put_u16(p, sw);
+	put_u16(p, cmd_len);
+	put_u16(length, resp_len);
+
+	capture_record(CAPTURE_APDU,
+		sizeof payload + cmd_len + sizeof length + resp_len);
+	capture_write(payload, sizeof payload);
+	capture_write(cmd, cmd_len);
+	capture_write(length, sizeof length);
+	capture_write(resp, resp_len);
+	capture_flush();
+}
+
+/* reader capabilities probed by -F
+ * The probe result is cached using the vendor, model and firmware
+ * version so identical readers are only probed once. The readers
+ * already seen are found using their name, without connecting to them. */
+typedef struct
+{
+	char *key;
+	char *text;	/* lines to display */
+} reader_caps_t;
+
+typedef struct
+{
+	char *name;
+	int caps;	/* index in Reader_caps */
+} probed_reader_t;
+
+static reader_caps_t *Reader_caps = NULL;
+static int Nb_reader_caps = 0;
+static probed_reader_t *Probed_readers = NULL;
+static int Nb_probed_readers = 0;
+
+static const char *Feature_names[] = {
+	NULL,
+	"VERIFY_PIN_START",			/* 0x01 */
+	"VERIFY_PIN_FINISH",		/* 0x02 */
+	"MODIFY_PIN_START",			/* 0x03 */
+	"MODIFY_PIN_FINISH",		/* 0x04 */
+	"GET_KEY_PRESSED",			/* 0x05 */
+	"VERIFY_PIN_DIRECT",		/* 0x06 */
+	"MODIFY_PIN_DIRECT",		/* 0x07 */
+	"MCT_READER_DIRECT",		/* 0x08 */
+	"MCT_UNIVERSAL",			/* 0x09 */
+	"IFD_PIN_PROPERTIES",		/* 0x0A */
+	"ABORT",					/* 0x0B */
+	"SET_SPE_MESSAGE",			/* 0x0C */
+	"VERIFY_PIN_DIRECT_APP_ID",	/* 0x0D */
+	"MODIFY_PIN_DIRECT_APP_ID",	/* 0x0E */
+	"WRITE_DISPLAY",			/* 0x0F */
+	"GET_KEY",					/* 0x10 */
+	"IFD_DISPLAY_PROPERTIES",	/* 0x11 */
+	"GET_TLV_PROPERTIES",		/* 0x12 */
+	"CCID_ESC_COMMAND",			/* 0x13 */
+	"EXECUTE_PACE",				/* 0x14 */
+};
+
+/* get a reader attribute
+ * return the size of the value or 0 if not available */
+static DWORD get_attrib(SCARDHANDLE hCard, DWORD attr, BYTE *value,
+	DWORD size)
+{
+	DWORD len = size;
+
+	if (SCardGetAttrib(hCard, attr, value, &len) != SCARD_S_SUCCESS
+		|| len > size)
+		return 0;
+
+	return len;
+}
+
+/* get a numeric attribute (little endian) */
+static bool get_attrib_dword(SCARDHANDLE hCard, DWORD attr, DWORD *value)
+{
+	BYTE buffer[8];
+	DWORD len = get_attrib(hCard, attr, buffer, sizeof buffer);
+
+	if (0 == len || len > 4)
+		return false;
+
+	*value = 0;
+	while (len--)
+		*value = *value << 8 | buffer[len];
+
+	return true;
+}
+
+/* get a string attribute */
+static bool get_attrib_string(SCARDHANDLE hCard, DWORD attr, char *value,
+	DWORD size)
+{
+	DWORD len = get_attrib(hCard, attr, (BYTE *)value, size - 1);
+
+	value[len] = '\0';
+	return len > 0 && value[0] != '\0';
+}
+
+static char *append_format(char *str, const char *format, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static char *append_format(char *str, const char *format, ...)
+{
+	char line[1024];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(line, sizeof line, format, ap);
+	va_end(ap);
+
+	return append_line(str, line);
+}
+
+/* append the reader capabilities that do not depend on the card */
+static char *probe_capabilities(SCARDHANDLE hCard, char *text)
+{
+	static const struct
+	{
+		DWORD attr;
+		const char *name;
+		const char *unit;
+	} attrs[] = {
+		{ SCARD_ATTR_DEFAULT_CLK, "default clock", "kHz" },
+		{ SCARD_ATTR_MAX_CLK, "max clock", "kHz" },
+		{ SCARD_ATTR_DEFAULT_DATA_RATE, "default data rate", "bit/s" },
+		{ SCARD_ATTR_MAX_DATA_RATE, "max data rate", "bit/s" },
+		{ SCARD_ATTR_MAX_IFSD, "max IFSD", "bytes" },
+		{ SCARD_ATTR_MAXINPUT, "max APDU size", "bytes" },
+	};
+	BYTE buffer[256];
+	char features[1024] = "";
+	DWORD value, len = 0, tlv_ioctl = 0;
+	LONG rv;
+
+	for (size_t i=0; i<sizeof attrs / sizeof *attrs; i++)
+		if (get_attrib_dword(hCard, attrs[i].attr, &value))
+			text = append_format(text, "%s: %lu %s", attrs[i].name,
+				(unsigned long)value, attrs[i].unit);
+
+	/* CCID features: tag (1 byte), length (1 byte), control code (4
+	 * bytes big endian) */
+	rv = SCardControl(hCard, CM_IOCTL_GET_FEATURE_REQUEST, NULL, 0, buffer,
+		sizeof buffer, &len);
+	if (SCARD_S_SUCCESS == rv)
+	{
+		for (DWORD i=0; i+6<=len; i+=6)
+		{
+			BYTE tag = buffer[i];
+			DWORD ioctl = (DWORD)buffer[i+2] << 24 | buffer[i+3] << 16
+				| buffer[i+4] << 8 | buffer[i+5];
+			size_t used = strlen(features);
+
+			if (tag < sizeof Feature_names / sizeof *Feature_names
+				&& Feature_names[tag])
+				snprintf(features + used, sizeof features - used, " %s",
+					Feature_names[tag]);
+			else
+				snprintf(features + used, sizeof features - used,
+					" 0x%02X", tag);
+
+			if (FEATURE_GET_TLV_PROPERTIES_TAG == tag)
+				tlv_ioctl = ioctl;
+		}
+	}
+	text = append_format(text, "features:%s", *features ? features : " none");
+
+	/* TLV properties: tag (1 byte), length (1 byte), value (little
+	 * endian) */
+	if (tlv_ioctl && SCARD_S_SUCCESS == SCardControl(hCard, tlv_ioctl, NULL,
+		0, buffer, sizeof buffer, &len))
+	{
+		for (DWORD i=0; i+2<=len && i+2+buffer[i+1]<=len; i+=2+buffer[i+1])
+		{
+			BYTE tag = buffer[i], tag_len = buffer[i+1];
+			const BYTE *v = buffer + i + 2;
+
+			value = 0;
+			for (int j=tag_len-1; j>=0 && tag_len<=4; j--)
+				value = value << 8 | v[j];
+
+			switch (tag)
+			{
+				case PART10_PROPERTY_dwMaxAPDUDataSize:
+					text = append_format(text, "max APDU data size: %lu bytes",
+						(unsigned long)value);
+					break;
+				case PART10_PROPERTY_wIdVendor:
+					text = append_format(text, "USB vendor ID: 0x%04lX",
+						(unsigned long)value);
+					break;
+				case PART10_PROPERTY_wIdProduct:
+					text = append_format(text, "USB product ID: 0x%04lX",
+						(unsigned long)value);
+					break;
+				case PART10_PROPERTY_sFirmwareID:
+					text = append_format(text, "firmware ID: %.*s", tag_len, v);
+					break;
+				case PART10_PROPERTY_bMinPINSize:
+					text = append_format(text, "min PIN size: %lu",
+						(unsigned long)value);
+					break;
+				case PART10_PROPERTY_bMaxPINSize:
+					text = append_format(text, "max PIN size: %lu",
+						(unsigned long)value);
+					break;
+			}
+		}
+	}
+
+	return text;
+}
+
+/* remember the capabilities of a reader using its name */
+static const char *add_probed_reader(const char *reader, int caps)
+{
+	Probed_readers = xrealloc(Probed_readers,
+		(Nb_probed_readers+1) * sizeof *Probed_readers);
+	Probed_readers[Nb_probed_readers].name = strdup(reader);
+	Probed_readers[Nb_probed_readers].caps = caps;
+	if (NULL == Probed_readers[Nb_probed_readers].name)
+	{
+		fprintf(stderr, "%s: strdup: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+	Nb_probed_readers++;
+
+	return Reader_caps[caps].text;
+}
+
+/* length of the reader name without the " XX YY" reader and slot numbers
+ * added by pcsc-lite ("%s %02X %02X") */
+static int reader_model_length(const char *reader)
+{
+	const char suffix[] = " 00 00";
+	int len = strlen(reader), start = len - (int)(sizeof suffix - 1);
+
+	if (start <= 0)
+		return len;
+
+	for (int i=0; suffix[i]; i++)
+	{
+		unsigned char c = reader[start + i];
+
+		if (' ' == suffix[i] ? c != ' ' : ! isxdigit(c))
+			return len;
+	}
+
+	return start;
+}
+
+/* return the capabilities of the reader or NULL if the reader can't be
+ * probed */
+static const char *probe_reader(SCARDCONTEXT hContext2, const char *reader)
+{
+	SCARDHANDLE hCard;
+	DWORD protocol, version;
+	char vendor[256], model[256], key[1024], firmware[64] = "";
+	char *text = NULL;
+	LONG rv;
+
+	/* reader already probed */
+	for (int i=0; i<Nb_probed_readers; i++)
+		if (0 == strcmp(reader, Probed_readers[i].name))
+			return Reader_caps[Probed_readers[i].caps].text;
+
+	/* direct connection: no card needed */
+	rv = SCardConnect(hContext2, reader, SCARD_SHARE_DIRECT, 0, &hCard,
+		&protocol);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		print_pcsc_error("SCardConnect(SCARD_SHARE_DIRECT)", rv);
+		return NULL;
+	}
+
+	if (! get_attrib_string(hCard, SCARD_ATTR_VENDOR_NAME, vendor, sizeof vendor))
+		strcpy(vendor, "unknown");
+
+	/* without the model use the reader name without the slot numbers */
+	if (! get_attrib_string(hCard, SCARD_ATTR_VENDOR_IFD_TYPE, model, sizeof model))
+		snprintf(model, sizeof model, "%.*s", reader_model_length(reader),
+			reader);
+
+	/* version: 0xMMmmbbbb */
+	if (get_attrib_dword(hCard, SCARD_ATTR_VENDOR_IFD_VERSION, &version))
+		snprintf(firmware, sizeof firmware, "%lu.%lu.%lu",
+			(unsigned long)(version >> 24), (unsigned long)(version >> 16 & 0xFF),
+			(unsigned long)(version & 0xFFFF));
+
+	snprintf(key, sizeof key, "%s\t%s\t%s", vendor, model, firmware);
+	for (int i=0; i<Nb_reader_caps; i++)
+		if (0 == strcmp(key, Reader_caps[i].key))
+		{
+			(void)SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+			return add_probed_reader(reader, i);
+		}
+
+	text = append_format(text, "vendor: %s, model: %s, firmware: %s", vendor,
+		model, *firmware ? firmware : "unknown");
+	text = probe_capabilities(hCard, text);
+
+	(void)SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+
+	Reader_caps = xrealloc(Reader_caps, (Nb_reader_caps+1) * sizeof *Reader_caps);
+	Reader_caps[Nb_reader_caps].key = strdup(key);
+	Reader_caps[Nb_reader_caps].text = text;
+	if (NULL == Reader_caps[Nb_reader_caps].key)
+	{
+		fprintf(stderr, "%s: strdup: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	return add_probed_reader(reader, Nb_reader_caps++);
+}
+
+static void free_reader_caps(void)
+{
+	for (int i=0; i<Nb_reader_caps; i++)
+	{
+		free(Reader_caps[i].key);
+		free(Reader_caps[i].text);
+	}
+	free(Reader_caps);
+	Reader_caps = NULL;
+	Nb_reader_caps = 0;
+
+	for (int i=0; i<Nb_probed_readers; i++)
+		free(Probed_readers[i].name);
+	free(Probed_readers);
+	Probed_readers = NULL;
+	Nb_probed_readers = 0;
+}
+
+/* print text indenting each line */
+static void print_indented(const char *indent, const char *text)
+{
+	for (const char *p = text; p && *p; p += strcspn(p, "\n") + 1)
+		printf("%s%.*s\n", indent, (int)strcspn(p, "\n"), p);
+}
+
+/* parameters negotiated with the card, when reported by the driver */
+static void print_negotiated(SCARDHANDLE hCard, DWORD protocol)
+{
+	DWORD clk, f, d, value;
+
+	printf("Negotiated: T=%d", SCARD_PROTOCOL_T0 == protocol ? 0 :
+		SCARD_PROTOCOL_T1 == protocol ? 1 : -1);
+
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_CLK, &clk))
+		printf(", clock: %lu kHz", (unsigned long)clk);
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_F, &f))
+		printf(", F: %lu", (unsigned long)f);
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_D, &d))
+		printf(", D: %lu", (unsigned long)d);
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_CLK, &clk)
+		&& get_attrib_dword(hCard, SCARD_ATTR_CURRENT_F, &f)
+		&& get_attrib_dword(hCard, SCARD_ATTR_CURRENT_D, &d) && f)
+		printf(", bit rate: %lu bit/s", (unsigned long)(clk * 1000ULL * d / f));
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_IFSC, &value))
+		printf(", IFSC: %lu", (unsigned long)value);
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_IFSD, &value))
+		printf(", IFSD: %lu", (unsigned long)value);
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_BWT, &value))
+		printf(", BWT: %lu", (unsigned long)value);
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_CWT, &value))
+		printf(", CWT: %lu", (unsigned long)value);
+	printf("\n");
+}
+
+/* convert the ATR in "3B 13 94 ..." */
+static void atr_to_string(const BYTE *atr, DWORD atr_len, char *out)
+{
+	unsigned int j;
+
+	out[0] = '\0';
+	for (j=0; j<atr_len; j++)
+		sprintf(&out[j*3], "%02X ", atr[j]);
+
+	if (j)
+		out[j*3-1] = '\0';
+}
+
+/* should the event of the reader be printed?
+ * Cards not matching the ATR filters are not reported, nor their
+ * removal */
+static bool event_reported(SCARD_READERSTATE *state, reader_data_t *data)
+{
+#if defined(__APPLE__) || defined(WIN32)
+	if (state->dwCurrentState == state->dwEventState)
+		return false;
+#endif
+	if (! (state->dwEventState & SCARD_STATE_CHANGED))
+		return false;
+
+	if (Nb_atr_filters)
+	{
+		if (state->dwEventState & SCARD_STATE_PRESENT)
+		{
+			char atr[MAX_ATR_SIZE*3+1];
+
+			atr_to_string(state->rgbAtr, state->cbAtr, atr);
+			data->card_filtered = ! atr_selected(atr);
+		}
+
+		if (data->card_filtered)
+		{
+			if (! (state->dwEventState & SCARD_STATE_PRESENT))
+				data->card_filtered = false;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* compare the measured APDU rate with the rate expected from the ATR
+ * and the parameters negotiated by the reader
+ * ATR_analysis is only run for a new card, protocol or set of parameters,
+ * the next series are compared with the ceiling it reported */
+static void bit_rate_report(SCARDHANDLE hCard, DWORD protocol, double rate,
+	DWORD send_length, DWORD recv_length)
+{
+	static char last_command[sizeof(ATR_PARSER) + MAX_ATR_SIZE*3+1 + 100];
+	static double ceiling = 0;
+	BYTE atr[MAX_ATR_SIZE];
+	char atr_string[MAX_ATR_SIZE*3+1];
+	char command[sizeof last_command], options[100], line[256];
+	DWORD atr_len = sizeof(atr), reader_len = 0, state, active_protocol;
+	DWORD clk, f, d;
+	int len;
+	char *p;
+	FILE *output;
+	LONG rv;
+
+	if (protocol != SCARD_PROTOCOL_T0 && protocol != SCARD_PROTOCOL_T1)
+		return;
+
+	rv = SCardStatus(hCard, NULL, &reader_len, &state, &active_protocol,
+		atr, &atr_len);
+	if (rv != SCARD_S_SUCCESS || 0 == atr_len)
+		return;
+	atr_to_string(atr, atr_len, atr_string);
+
+	len = snprintf(options, sizeof(options), " -L %lu:%lu -T %d",
+		(unsigned long)send_length, (unsigned long)recv_length,
+		SCARD_PROTOCOL_T0 == protocol ? 0 : 1);
+
+	/* F, D and clock really used by the reader, if reported */
+	if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_F, &f)
+		&& get_attrib_dword(hCard, SCARD_ATTR_CURRENT_D, &d) && f && d)
+	{
+		len += snprintf(options + len, sizeof(options) - len, " -P %lu:%lu",
+			(unsigned long)f, (unsigned long)d);
+		if (get_attrib_dword(hCard, SCARD_ATTR_CURRENT_CLK, &clk) && clk)
+			snprintf(options + len, sizeof(options) - len, ":%lu",
+				(unsigned long)clk);
+	}
+
+	/* same card and same parameters: the prediction is already known */
+	snprintf(command, sizeof(command), ATR_PARSER "%s '%s'", options,
+		atr_string);
+	if (ceiling > 0 && 0 == strcmp(command, last_command))
+	{
+		printf("%.1f%% of the %.1f APDU/s ceiling\n", rate * 100 / ceiling,
+			ceiling);
+		return;
+	}
+
+	snprintf(command, sizeof(command), ATR_PARSER "%s -M %.1f '%s'",
+		options, rate, atr_string);
+	printf("\n");
+	fflush(stdout);
+	output = popen(command, "r");
+	if (NULL == output)
+	{
+		perror(command);
+		return;
+	}
+
+	/* keep the last ceiling reported for the next series */
+	ceiling = 0;
+	while (fgets(line, sizeof line, output))
+	{
+		fputs(line, stdout);
+		p = strstr(line, "% of the ");
+		if (p)
+			ceiling = strtod(p + strlen("% of the "), NULL);
+	}
+
+	if (pclose(output))
+	{
+		fprintf(stderr, "%s: failed\n", command);
+		ceiling = 0;
+	}
+
+	snprintf(last_command, sizeof(last_command), ATR_PARSER "%s '%s'",
+		options, atr_string);
+}
+
+static LONG stress(SCARDCONTEXT hContext2, const char *readerName)
+{
+	LONG rv, ret_rv = SCARD_S_SUCCESS;
+	SCARDHANDLE hCard;
+	DWORD dwActiveProtocol;
+	const SCARD_IO_REQUEST *pioSendPci;
+	bool capture = capture_open();
+	int reader_id = capture ? capture_reader_id(readerName) : 0;
+
+	printf("Stress card in reader: %s\n", readerName);
+	if (Options.probe)
+		print_indented("  ", probe_reader(hContext2, readerName));
+	printf("\n");
+
+	rv = SCardConnect(hContext2, readerName, SCARD_SHARE_SHARED,
+			SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &hCard, &dwActiveProtocol);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		print_pcsc_error("SCardConnect", rv);
+		return rv;
+	}
+
+	if (Options.probe)
+		print_negotiated(hCard, dwActiveProtocol);
+
+	/* Select Master File */
+	BYTE pbSendBuffer[] = {0, 0xA4, 0, 0, 2, 0x3F, 0};
+	BYTE pbRecvBuffer[256+2];
+	DWORD dwSendLength, dwRecvLength;
+	struct timeval time_start, time_end;
+
+	switch (dwActiveProtocol)
+	{
+		case SCARD_PROTOCOL_T0:
+			pioSendPci = SCARD_PCI_T0;
+			break;
+		case SCARD_PROTOCOL_T1:
+			pioSendPci = SCARD_PCI_T1;
+			break;
+		case SCARD_PROTOCOL_RAW:
+			pioSendPci = SCARD_PCI_RAW;
+			break;
+		default:
+			fprintf(stderr, "Unknown protocol\n");
+			return -1;
+	}
+
+	gettimeofday(&time_start, NULL);
+
+
+#define COUNT 100
+	int count;
+	for (count=0; count<COUNT; count++)
+	{
+		printf("%sFAPDU n°: %d\n", cpl, count);
+		dwSendLength = sizeof(pbSendBuffer);
+		dwRecvLength = sizeof(pbRecvBuffer);
+		long long apdu_start = capture ? monotonic_ns() : 0;
+		rv = SCardTransmit(hCard, pioSendPci, pbSendBuffer, dwSendLength,
+			NULL, pbRecvBuffer, &dwRecvLength);
+		if (capture)
+			capture_apdu(reader_id, dwActiveProtocol, rv, apdu_start,
+				monotonic_ns(), pbSendBuffer, dwSendLength, pbRecvBuffer,
+				dwRecvLength);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			print_pcsc_error("SCardTransmit", rv);
+			ret_rv = rv;
+			break;
+		}
+
+		if (Interrupted)
+			exit(EX_OSERR);
+	}
+
+	gettimeofday(&time_end, NULL);
+	struct timeval r;
+	r.tv_sec = time_end.tv_sec - time_start.tv_sec;
+	r.tv_usec = time_end.tv_usec - time_start.tv_usec;
+	if (r.tv_usec < 0)
+	{
+		r.tv_sec--;
+		r.tv_usec += 1000000;
+	}
+	long delta = r.tv_sec * 1000000 + r.tv_usec;
+	printf("Total time: %ld µs\n", delta);
+	if (0 == count)
+		count = 1;
+	if (0 == delta)
+		delta = 1;
+	double rate = count * 1000000. / delta;
+	printf("%f APDU/s\n", rate);
+
+	if (Options.analyse_atr && SCARD_S_SUCCESS == ret_rv)
+		bit_rate_report(hCard, dwActiveProtocol, rate, dwSendLength,
+			dwRecvLength);
+
+	rv = SCardDisconnect(hCard, SCARD_UNPOWER_CARD);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		print_pcsc_error("SCardDisconnect", rv);
+		ret_rv = rv;
+	}
+
+	return ret_rv;
+}
+
+static void print_readers(const char **readers, int nbReaders)
+{
+	int i = 0;
+	for (i = 0;i < nbReaders; i++)
+	{
+		printf("%s%d: %s%s\n", blue, i, readers[i], color_end);
+		if (Options.probe)
+			print_indented("   ", probe_reader(hContext, readers[i]));
+	}
+}
+
+static void displayChangedStatus(SCARD_READERSTATE rgReaderStates[], int count)
+{
+	printf("\n");
+	for (int i=0; i<count; i++)
+	{
+		SCARD_READERSTATE r = rgReaderStates[i];
+		printf("%d: %s, %d, 0x%04X -> 0x%04X",
+			i,
+			r.szReader,
+			(int)(r.dwEventState >> 16),
+			(int)(r.dwCurrentState & 0xFFFF),
+			(int)(r.dwEventState & 0xFFFF));
+		for (int b=0; b<11; b++)
+		{
+			int v = 1 << b;
+			if ((r.dwEventState & v) && (r.dwCurrentState & v))
+				printf(" =%s", State_names[b]);
+			if ((r.dwEventState & v) && !(r.dwCurrentState & v))
+				printf(" %s+%s%s", blue, State_names[b], color_end);
+			if (!(r.dwEventState & v) && (r.dwCurrentState & v))
+				printf(" %s-%s%s", red, State_names[b], color_end);
+		}
+		printf("\n");
+	}
+}
+
+/* Collapse the transitions occurring during the debounce window of each
+ * reader into their final state.
+ * On return only the readers whose final state (or card) differs from
+ * the last reported one have SCARD_STATE_CHANGED set in dwEventState.
+ * Their dwCurrentState is the last reported state.
+ * The transitions of a window ending in the state it started from are
+ * added to the next report of the reader. */
+static LONG debounce(SCARDCONTEXT hContext2, SCARD_READERSTATE states[],
+	reader_data_t data[], int nbReaders)
+{
+	long long now = monotonic_us();
+	bool pnp = false;
+	LONG rv = SCARD_S_SUCCESS;
+
+	for (;;)
+	{
+		long long next = -1;
+
+		/* register the new transitions */
+		for (int i=0; i<nbReaders; i++)
+		{
+			reader_data_t *d = &data[i];
+
+			if (!(states[i].dwEventState & SCARD_STATE_CHANGED))
+				continue;
+
+			if (d->is_pnp)
+			{
+				/* the list of readers will be reloaded */
+				pnp = true;
+				continue;
+			}
+
+			if (! d->pending)
+			{
+				d->pending = true;
+				d->transitions = 0;
+				d->reported_state = states[i].dwCurrentState;
+				d->deadline = now + d->debounce_ms * 1000LL;
+			}
+			d->transitions++;
+
+			/* wait for the next transition */
+			states[i].dwEventState &= ~SCARD_STATE_CHANGED;
+			states[i].dwCurrentState = states[i].dwEventState;
+		}
+
+		/* first end of a debounce window */
+		for (int i=0; i<nbReaders; i++)
+			if (data[i].pending && (next < 0 || data[i].deadline < next))
+				next = data[i].deadline;
+
+		if (pnp || next < 0 || now >= next)
+			break;
+
+		rv = SCardGetStatusChange(hContext2, (next - now + 999) / 1000,
+			states, nbReaders);
+
+		/* the statistics are printed after the debounce: continue to
+		 * wait until the end of the window */
+		rv = stats_wakeup(rv, states, nbReaders);
+		if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
+			break;
+
+		rv = SCARD_S_SUCCESS;
+		now = monotonic_us();
+	}
+
+	/* report only the real changes of the readers at the end of their
+	 * window. The other readers stay pending, see debounce_timeout().
+	 * All the readers are reported if the list of readers is reloaded. */
+	for (int i=0; i<nbReaders; i++)
+	{
+		reader_data_t *d = &data[i];
+		DWORD mask = 0xFFFF & ~SCARD_STATE_CHANGED;
+		bool changed;
+
+		if (d->is_pnp || ! d->pending)
+			continue;
+
+		if (! pnp && rv == SCARD_S_SUCCESS && d->deadline > now)
+			continue;
+
+		d->pending = false;
+		changed = (states[i].dwEventState & mask) != (d->reported_state & mask)
+			|| states[i].cbAtr != d->reported_cbAtr
+			|| memcmp(states[i].rgbAtr, d->reported_atr, states[i].cbAtr);
+
+		if (changed)
+		{
+			states[i].dwEventState |= SCARD_STATE_CHANGED;
+			states[i].dwCurrentState = d->reported_state;
+			d->reported_cbAtr = states[i].cbAtr;
+			memcpy(d->reported_atr, states[i].rgbAtr, states[i].cbAtr);
+			d->transitions--;
+		}
+
+		d->suppressed += d->transitions;
+	}
+
+	return rv;
+}
+
+/* timeout in ms of SCardGetStatusChange() to end the first pending
+ * debounce window in time */
+static DWORD debounce_timeout(const reader_data_t data[], int nbReaders)
+{
+	long long now = monotonic_us(), next = -1;
+
+	for (int i=0; i<nbReaders; i++)
+		if (data[i].pending && (next < 0 || data[i].deadline < next))
+			next = data[i].deadline;
+
+	if (next < 0)
+		return TIMEOUT;
+
+	return next > now ? (next - now + 999) / 1000 : 0;
+}
+
+/* reader statistics (-U secs and SIGUSR1)
+ * The memory used is fixed: histograms of log2(ms) buckets and the
+ * number of insertions during each of the last 60 minutes */
+#define STATS_MAX_READERS 64
+#define STATS_BUCKETS 32	/* 2^31 ms is more than 24 days */
+#define STATS_MINUTES 60
+
+typedef struct
+{
+	unsigned long count[STATS_BUCKETS];
+	unsigned long total;
+	long long sum_ms;
+	long long max_ms;
+} histogram_t;
+
+typedef struct
+{
+	char *name;
+	bool present;
+	bool mute;
+	bool partial;	/* the current period started before we were running */
+	long long since_us;	/* start of the current period */
+	long long first_us;	/* first time the reader was seen */
+	long long present_us;	/* total time with a card */
+	unsigned long insertions;
+	unsigned long removals;
+	unsigned long mutes;
+	histogram_t dwell;	/* card inserted */
+	histogram_t idle;	/* no card */
+	unsigned int minutes[STATS_MINUTES];
+	long long minute;	/* minute of the last insertion */
+} reader_stats_t;
+
+static reader_stats_t Reader_stats[STATS_MAX_READERS];
+static int Nb_reader_stats = 0;
+static long long Stats_start_us = 0;
+
+static reader_stats_t *stats_find(const char *reader)
+{
+	for (int i=0; i<Nb_reader_stats; i++)
+		if (0 == strcmp(Reader_stats[i].name, reader))
+			return &Reader_stats[i];
+
+	/* too many readers: the new ones are ignored */
+	if (Nb_reader_stats >= STATS_MAX_READERS)
+		return NULL;
+
+	reader_stats_t *stats = &Reader_stats[Nb_reader_stats];
+	stats->name = strdup(reader);
+	if (NULL == stats->name)
+		return NULL;
+	Nb_reader_stats++;
+
+	return stats;
+}
+
+static void histogram_add(histogram_t *histogram, long long ms)
+{
+	int bucket = 0;
+
+	while (bucket < STATS_BUCKETS-1 && ms >= 2LL << bucket)
+		bucket++;
+
+	histogram->count[bucket]++;
+	histogram->total++;
+	histogram->sum_ms += ms;
+	if (ms > histogram->max_ms)
+		histogram->max_ms = ms;
+}
+
+/* number of insertions during the last n minutes */
+static unsigned long stats_insertions(const reader_stats_t *stats, long long now,
+	int n)
+{
+	long long minute = now / 60000000;
+	unsigned long total = 0;
+
+	/* the monotonic clock may start at boot */
+	for (int i=0; i<n && minute - i >= 0; i++)
+		if (minute - i <= stats->minute && stats->minute - (minute - i) < STATS_MINUTES)
+			total += stats->minutes[(minute - i) % STATS_MINUTES];
+
+	return total;
+}
+
+/* register the new state of the reader */
+static void stats_update(const char *reader, DWORD state)
+{
+	reader_stats_t *stats;
+	long long now = monotonic_us();
+	bool present = state & SCARD_STATE_PRESENT;
+
+	if (state & (SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE | SCARD_STATE_IGNORE))
+		return;
+
+	stats = stats_find(reader);
+	if (NULL == stats)
+		return;
+
+	if (0 == stats->first_us)
+	{
+		/* the first period is not complete */
+		stats->first_us = stats->since_us = now;
+		stats->present = present;
+		stats->mute = present && (state & SCARD_STATE_MUTE);
+		stats->partial = true;
+		return;
+	}
+
+	if (present == stats->present)
+	{
+		/* a card becoming mute */
+		if (present && (state & SCARD_STATE_MUTE) && ! stats->mute)
+		{
+			stats->mute = true;
+			stats->mutes++;
+		}
+		return;
+	}
+
+	long long ms = (now - stats->since_us) / 1000;
+	if (stats->present)
+	{
+		stats->removals++;
+		stats->present_us += now - stats->since_us;
+		if (! stats->partial)
+			histogram_add(&stats->dwell, ms);
+	}
+	else
+	{
+		long long minute = now / 60000000;
+
+		stats->insertions++;
+		if (! stats->partial)
+			histogram_add(&stats->idle, ms);
+
+		/* clear the minutes without insertion */
+		for (long long m = stats->minute + 1; m <= minute
+			&& m <= stats->minute + STATS_MINUTES; m++)
+			stats->minutes[m % STATS_MINUTES] = 0;
+		if (stats->minute < minute)
+			stats->minute = minute;
+		stats->minutes[minute % STATS_MINUTES]++;
+
+		stats->mute = state & SCARD_STATE_MUTE;
+		if (stats->mute)
+			stats->mutes++;
+	}
+
+	stats->present = present;
+	stats->since_us = now;
+	stats->partial = false;
+}
+
+static void format_duration(char *buffer, size_t size, long long ms)
+{
+	if (ms < 1000)
+		snprintf(buffer, size, "%lld ms", ms);
+	else if (ms < 60 * 1000)
+		snprintf(buffer, size, "%.1f s", ms / 1000.);
+	else if (ms < 3600 * 1000)
+		snprintf(buffer, size, "%.1f min", ms / 60000.);
+	else
+		snprintf(buffer, size, "%.1f h", ms / 3600000.);
+}
+
+/* upper bound of the bucket containing the given percentile */
+static long long histogram_percentile(const histogram_t *histogram, int p)
+{
+	unsigned long n = 0;
+
+	for (int i=0; i<STATS_BUCKETS; i++)
+	{
+		n += histogram->count[i];
+		if (n * 100 >= histogram->total * p)
+			return 2LL << i;
+	}
+
+	return histogram->max_ms;
+}
+
+static void print_histogram(const char *name, const histogram_t *histogram)
+{
+	char mean[32], p50[32], p90[32], max[32];
+
+	if (0 == histogram->total)
+		return;
+
+	format_duration(mean, sizeof mean, histogram->sum_ms / histogram->total);
+	format_duration(p50, sizeof p50, histogram_percentile(histogram, 50));
+	format_duration(p90, sizeof p90, histogram_percentile(histogram, 90));
+	format_duration(max, sizeof max, histogram->max_ms);
+	printf("  %s: %lu, mean: %s, median < %s, p90 < %s, max: %s\n", name,
+		histogram->total, mean, p50, p90, max);
+
+	for (int i=0; i<STATS_BUCKETS; i++)
+	{
+		char low[32], high[32];
+
+		if (0 == histogram->count[i])
+			continue;
+
+		format_duration(low, sizeof low, i ? 1LL << i : 0);
+		format_duration(high, sizeof high, 2LL << i);
+		printf("   [%s, %s): %lu\n", low, high, histogram->count[i]);
+	}
+}
+
+static void print_stats(void)
+{
+	long long now = monotonic_us();
+	long long uptime = now - Stats_start_us;
+	char duration[32];
+
+	format_duration(duration, sizeof duration, uptime / 1000);
+	printf("\n%sReader statistics after %s%s\n", magenta, duration, color_end);
+
+	Stats_requested = false;
+	if (Options.stats_interval)
+		Next_stats_us = now + Options.stats_interval * 1000000LL;
+
+	for (int i=0; i<Nb_reader_stats; i++)
+	{
+		const reader_stats_t *stats = &Reader_stats[i];
+		long long observed = now - stats->first_us;
+		long long present_us = stats->present_us;
+
+		if (stats->present)
+			present_us += now - stats->since_us;
+
+		printf(" Reader: %s%s%s\n", magenta, stats->name, color_end);
+		printf("  card %s for ", stats->present ? "present" : "absent");
+		format_duration(duration, sizeof duration, (now - stats->since_us) / 1000);
+		printf("%s\n", duration);
+		printf("  insertions: %lu, removals: %lu\n", stats->insertions,
+			stats->removals);
+		printf("  insertions per minute: %lu (current minute), %.1f (last 15 minutes), %.1f (last hour)\n",
+			stats_insertions(stats, now, 1),
+			stats_insertions(stats, now, 15) / 15.,
+			stats_insertions(stats, now, 60) / 60.);
+		if (stats->insertions)
+			printf("  mute cards: %lu (%.1f%%)\n", stats->mutes,
+				stats->mutes * 100. / stats->insertions);
+		if (observed > 0)
+			printf("  utilisation: %.1f%%\n", present_us * 100. / observed);
+		print_histogram("dwell time", &stats->dwell);
+		print_histogram("idle time", &stats->idle);
+	}
+
+	fflush(stdout);
+}
+
+static void free_stats(void)
+{
+	for (int i=0; i<Nb_reader_stats; i++)
+		free(Reader_stats[i].name);
+	Nb_reader_stats = 0;
+}
+
+/* ATR identification service (ATR_analysis -d) */
+#define ATR_SERVICE_VERSION 1
+#define ATR_SERVICE_IDENTIFY 1
+#define ATR_SERVICE_DECODE 2
+#define ATR_SERVICE_NOT_FOUND 1
+#define ATR_SERVICE_ERROR 2
+#define ATR_SERVICE_TIMEOUT 5	/* in seconds */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef WIN32
+/* socket of the service using the same rules as ATR_analysis
+ * return NULL if the service is disabled */
+static const char *atr_service_path(char *path, size_t size)
+{
+	const char *env = getenv("PCSC_ATR_SOCKET");
+
+	if (env)
+		/* an empty value disables the service */
+		return '\0' == *env ? NULL : env;
+
+	if ((env = getenv("XDG_RUNTIME_DIR")))
+		snprintf(path, size, "%s/pcsc_atr.sock", env);
+	else if ((env = getenv("XDG_CACHE_HOME")))
+		snprintf(path, size, "%s/pcsc_atr.sock", env);
+	else if ((env = getenv("HOME")))
+		snprintf(path, size, "%s/.cache/pcsc_atr.sock", env);
+	else
+		return NULL;
+
+	return path;
+}
+
+static bool read_all(int fd, void *buffer, size_t len)
+{
+	char *p = buffer;
+
+	while (len > 0)
+	{
+		ssize_t n = read(fd, p, len);
+
+		if (n < 0 && EINTR == errno)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* send a request to the ATR identification service
+ * return the malloc()ed text of the response or NULL if the service is
+ * not available */
+static char *atr_service_query(int op, const BYTE *atr, DWORD atr_len,
+	int *status)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = { ATR_SERVICE_TIMEOUT, 0 };
+	unsigned char request[4 + MAX_ATR_SIZE], header[6];
+	char path[sizeof addr.sun_path];
+	const char *socket_path;
+	char *text = NULL;
+	size_t len;
+	int fd;
+
+	socket_path = atr_service_path(path, sizeof path);
+	if (NULL == socket_path || strlen(socket_path) >= sizeof addr.sun_path
+		|| atr_len > MAX_ATR_SIZE)
+		return NULL;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return NULL;
+
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+		goto end;
+
+	request[0] = ATR_SERVICE_VERSION;
+	request[1] = op;
+	request[2] = atr_len >> 8;
+	request[3] = atr_len & 0xFF;
+	memcpy(request + 4, atr, atr_len);
+	if (send(fd, request, 4 + atr_len, MSG_NOSIGNAL) != (ssize_t)(4 + atr_len))
+		goto end;
+
+	if (! read_all(fd, header, sizeof header)
+		|| header[0] != ATR_SERVICE_VERSION
+		|| header[1] == ATR_SERVICE_ERROR)
+		goto end;
+
+	len = (size_t)header[2] << 24 | header[3] << 16 | header[4] << 8 | header[5];
+	text = malloc(len + 1);
+	if (NULL == text)
+	{
+		fprintf(stderr, "%s: malloc: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	if (! read_all(fd, text, len))
+	{
+		free(text);
+		text = NULL;
+		goto end;
+	}
+	text[len] = '\0';
+
+	if (status)
+		*status = header[1];
+
+end:
+	close(fd);
+	return text;
+}
+#endif
+
+/* open the card list using the same search order as ATR_analysis */
+static FILE *open_smartcard_list(void)
+{
+	const char *home = getenv("HOME");
+	const char *cache = getenv("XDG_CACHE_HOME");
+	char path[4096];
+	FILE *f = NULL;
+
+	if (cache)
+	{
+		snprintf(path, sizeof path, "%s/smartcard_list.txt", cache);
+		f = fopen(path, "r");
+	}
+	else if (home)
+	{
+		snprintf(path, sizeof path, "%s/.cache/smartcard_list.txt", home);
+		f = fopen(path, "r");
+	}
+
+	if (NULL == f && home)
+	{
+		snprintf(path, sizeof path, "%s/.smartcard_list.txt", home);
+		f = fopen(path, "r");
+	}
+
+#ifdef PCSC_DIR
+	if (NULL == f)
+		f = fopen(PCSC_DIR "/smartcard_list.txt", "r");
+#endif
+
+	return f;
+}
+
+/* does the ATR pattern line of smartcard_list.txt match atr? */
+static bool atr_line_match(const char *line, const char *atr)
+{
+	size_t prefix = strspn(line, "0123456789ABCDEF ");
+	atr_pattern_t pattern;
+	bool match;
+
+	/* literal ATR */
+	if ('\0' == line[prefix])
+		return 0 == strcmp(line, atr);
+
+	/* avoid compiling the regex if the fixed prefix does not match */
+	if (NULL == strchr(line, '|') && 0 != strncmp(line, atr, prefix))
+		return false;
+
+	if (atr_pattern_compile(&pattern, line))
+		return false;
+
+	match = atr_pattern_match(&pattern, atr);
+	atr_pattern_free(&pattern);
+
+	return match;
+}
+
+#ifndef WIN32
+/* identify_cards() using the identification service
+ * return false if the service is not available */
+static bool identify_cards_with_service(const char *atrs[],
+	char *descriptions[], int count)
+{
+	for (int i=0; i<count; i++)
+	{
+		BYTE atr[MAX_ATR_SIZE];
+		unsigned int byte;
+		DWORD atr_len = 0;
+		char *text, *line, *next;
+		int status;
+
+		if (NULL == atrs[i])
+			continue;
+
+		/* "3B 02 14 50" -> binary */
+		for (const char *p = atrs[i];
+			atr_len < sizeof atr && 1 == sscanf(p, "%2x", &byte); p += 3)
+		{
+			atr[atr_len++] = byte;
+			if ('\0' == p[2])
+				break;
+		}
+
+		text = atr_service_query(ATR_SERVICE_IDENTIFY, atr, atr_len, &status);
+		if (NULL == text)
+		{
+			for (int j=0; j<i; j++)
+			{
+				free(descriptions[j]);
+				descriptions[j] = NULL;
+			}
+			return false;
+		}
+
+		/* the first line is the list file and the descriptions are
+		 * indented with a tab */
+		for (line = text; *line; line = next)
+		{
+			next = line + strcspn(line, "\n");
+			if (*next)
+				*next++ = '\0';
+
+			if ('\t' == line[0])
+				descriptions[i] = append_line(descriptions[i],
+					line + strspn(line, "\t"));
+		}
+		free(text);
+	}
+
+	return true;
+}
+#endif
+
+/* get the card descriptions found in smartcard_list.txt for all the ATRs
+ * in only one pass. descriptions[i] is set to a malloc()ed string of
+ * lines or NULL if atrs[i] is NULL or not found. */
+static void identify_cards(const char *atrs[], char *descriptions[], int count)
+{
+	char line[1024];
+	bool *match;
+	FILE *f;
+
+	for (int i=0; i<count; i++)
+		descriptions[i] = NULL;
+
+#ifndef WIN32
+	/* avoid reading the list if the identification service is running */
+	if (identify_cards_with_service(atrs, descriptions, count))
+		return;
+#endif
+
+	f = open_smartcard_list();
+	if (NULL == f)
+		return;
+
+	match = calloc(count+1, sizeof *match);
+	if (NULL == match)
+	{
+		fprintf(stderr, "%s: calloc: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	while (fgets(line, sizeof line, f))
+	{
+		/* comment */
+		if ('#' == line[0])
+			continue;
+
+		line[strcspn(line, "\r\n")] = '\0';
+
+		/* description */
+		if ('\t' == line[0])
+		{
+			for (int i=0; i<count; i++)
+				if (match[i])
+					descriptions[i] = append_line(descriptions[i],
+						line + strspn(line, "\t"));
+			continue;
+		}
+
+		if ('\0' == line[0])
+			continue;
+
+		for (int i=0; i<count; i++)
+			match[i] = atrs[i] && atr_line_match(line, atrs[i]);
+	}
+	fclose(f);
+	free(match);
+}
+
+/* ATR analysis done by worker threads so the cards reported by the same
+ * SCardGetStatusChange() are analysed in parallel. The jobs are submitted
+ * before the events are reported and the main loop prints the results in
+ * the reader order, waiting for each one only when it is needed. */
+typedef struct analysis_job
+{
+	BYTE atr[MAX_ATR_SIZE];
+	DWORD atr_len;
+	char *text;	/* output of the analysis */
+	bool done;
+	bool abandoned;	/* the result is not wanted, the worker frees the job */
+	struct analysis_job *next;
+} analysis_job_t;
+
+static analysis_job_t *Analysis_queue = NULL;
+static analysis_job_t **Analysis_tail = &Analysis_queue;
+static pthread_t *Analysis_threads = NULL;
+static int Nb_analysis_threads = 0;
+static bool Analysis_stop = false;
+static pthread_mutex_t Analysis_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Analysis_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Analysis_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* return the malloc()ed output of the ATR analysis */
+static char *atr_analysis(const BYTE *atr, DWORD atr_len)
+{
+	char atr_string[MAX_ATR_SIZE*3+1];
+	char command[sizeof(atr_string)+sizeof(ATR_PARSER)+2+1];
+	char buffer[4096];
+	char *text = NULL;
+	size_t len = 0, n;
+	FILE *f;
+
+#ifndef WIN32
+	/* use the identification service if available */
+	text = atr_service_query(ATR_SERVICE_DECODE, atr, atr_len, NULL);
+	if (text)
+		return text;
+#endif
+
+	atr_to_string(atr, atr_len, atr_string);
+	snprintf(command, sizeof command, ATR_PARSER " '%s'", atr_string);
+
+	f = popen(command, "r");
+	if (NULL == f)
+		return append_format(NULL, "%s: %s", command, strerror(errno));
+
+	text = xrealloc(text, 1);
+	text[0] = '\0';
+	while ((n = fread(buffer, 1, sizeof buffer, f)) > 0)
+	{
+		text = xrealloc(text, len + n + 1);
+		memcpy(text + len, buffer, n);
+		len += n;
+		text[len] = '\0';
+	}
+
+	if (pclose(f))
+		text = append_format(text, "%s: failed", command);
+
+	return text;
+}
+
+static void *analysis_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&Analysis_mutex);
+	for (;;)
+	{
+		analysis_job_t *job;
+		char *text = NULL;
+
+		while (NULL == Analysis_queue && ! Analysis_stop)
+			pthread_cond_wait(&Analysis_cond, &Analysis_mutex);
+
+		job = Analysis_queue;
+		if (NULL == job || Analysis_stop)
+			break;
+
+		Analysis_queue = job->next;
+		if (NULL == Analysis_queue)
+			Analysis_tail = &Analysis_queue;
+
+		if (! job->abandoned)
+		{
+			pthread_mutex_unlock(&Analysis_mutex);
+			text = atr_analysis(job->atr, job->atr_len);
+			pthread_mutex_lock(&Analysis_mutex);
+		}
+
+		if (job->abandoned)
+		{
+			free(text);
+			free(job);
+			continue;
+		}
+
+		job->text = text;
+		job->done = true;
+		pthread_cond_broadcast(&Analysis_done_cond);
+	}
+	pthread_mutex_unlock(&Analysis_mutex);
+
+	return NULL;
+}
+
+/* queue the analysis of an ATR
+ * return NULL if no worker can be started */
+static analysis_job_t *analysis_submit(const BYTE *atr, DWORD atr_len)
+{
+	analysis_job_t *job;
+
+	/* start the workers the first time */
+	if (NULL == Analysis_threads)
+	{
+		Analysis_threads = calloc(Options.workers, sizeof *Analysis_threads);
+		if (NULL == Analysis_threads)
+		{
+			fprintf(stderr, "%s: calloc: not enough memory\n", Options.pname);
+			exit(EX_OSERR);
+		}
+
+		while (Nb_analysis_threads < Options.workers
+			&& 0 == pthread_create(&Analysis_threads[Nb_analysis_threads],
+				NULL, analysis_worker, NULL))
+			Nb_analysis_threads++;
+	}
+
+	if (0 == Nb_analysis_threads || atr_len > MAX_ATR_SIZE)
+		return NULL;
+
+	job = calloc(1, sizeof *job);
+	if (NULL == job)
+	{
+		fprintf(stderr, "%s: calloc: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+	memcpy(job->atr, atr, atr_len);
+	job->atr_len = atr_len;
+
+	pthread_mutex_lock(&Analysis_mutex);
+	*Analysis_tail = job;
+	Analysis_tail = &job->next;
+	pthread_cond_signal(&Analysis_cond);
+	pthread_mutex_unlock(&Analysis_mutex);
+
+	return job;
+}
+
+/* wait for the end of the analysis and return its malloc()ed output */
+static char *analysis_wait(analysis_job_t *job)
+{
+	char *text;
+
+	pthread_mutex_lock(&Analysis_mutex);
+	while (! job->done)
+		pthread_cond_wait(&Analysis_done_cond, &Analysis_mutex);
+	text = job->text;
+	pthread_mutex_unlock(&Analysis_mutex);
+
+	free(job);
+
+	return text;
+}
+
+/* drop the analyses not reported, for example when the readers list is
+ * reloaded in the middle of the events */
+static void analysis_discard(reader_data_t data[], int count)
+{
+	pthread_mutex_lock(&Analysis_mutex);
+	for (int i=0; i<count; i++)
+	{
+		analysis_job_t *job = data[i].analysis;
+
+		if (NULL == job)
+			continue;
+
+		data[i].analysis = NULL;
+		if (job->done)
+		{
+			free(job->text);
+			free(job);
+		}
+		else
+			job->abandoned = true;
+	}
+	pthread_mutex_unlock(&Analysis_mutex);
+}
+
+static void analysis_stop(void)
+{
+	pthread_mutex_lock(&Analysis_mutex);
+	Analysis_stop = true;
+	pthread_cond_broadcast(&Analysis_cond);
+	pthread_mutex_unlock(&Analysis_mutex);
+
+	for (int i=0; i<Nb_analysis_threads; i++)
+		pthread_join(Analysis_threads[i], NULL);
+
+	/* jobs never started */
+	while (Analysis_queue)
+	{
+		analysis_job_t *job = Analysis_queue;
+
+		Analysis_queue = job->next;
+		free(job->text);
+		free(job);
+	}
+	Analysis_tail = &Analysis_queue;
+
+	free(Analysis_threads);
+	Analysis_threads = NULL;
+	Nb_analysis_threads = 0;
+}
+
+/* ordered reporting stage
+ * With the analysis workers the output of the events is written in
+ * memory and the main thread goes back to waiting for the next events.
+ * The reports are printed in the event order as soon as the analyses
+ * they contain are done. */
+#define REPORT_POLL_MS 100	/* check of the pending analyses */
+
+typedef struct report
+{
+	char *text;	/* printed before the result of the analysis */
+	analysis_job_t *job;	/* or NULL */
+	struct report *next;
+} report_t;
+
+static report_t *Reports = NULL;
+static report_t **Reports_tail = &Reports;
+static char *Report_buffer = NULL;
+static size_t Report_size = 0;
+
+static FILE *report_open(void)
+{
+	FILE *out = NULL;
+
+#ifndef WIN32
+	out = open_memstream(&Report_buffer, &Report_size);
+#endif
+	if (NULL == out)
+	{
+		fprintf(stderr, "%s: open_memstream: %s\n", Options.pname,
+			strerror(errno));
+		exit(EX_OSERR);
+	}
+
+	return out;
+}
+
+/* end the current part of the report, followed by the result of job */
+static void report_add(FILE *out, analysis_job_t *job)
+{
+	report_t *report;
+
+	fclose(out);
+	if (0 == Report_size && NULL == job)
+	{
+		free(Report_buffer);
+		return;
+	}
+
+	report = calloc(1, sizeof *report);
+	if (NULL == report)
+	{
+		fprintf(stderr, "%s: calloc: not enough memory\n", Options.pname);
+		exit(EX_OSERR);
+	}
+	report->text = Report_buffer;
+	report->job = job;
+
+	*Reports_tail = report;
+	Reports_tail = &report->next;
+}
+
+/* can the first report be printed? */
+static bool report_ready(void)
+{
+	bool ready;
+
+	if (NULL == Reports)
+		return false;
+
+	pthread_mutex_lock(&Analysis_mutex);
+	ready = NULL == Reports->job || Reports->job->done;
+	pthread_mutex_unlock(&Analysis_mutex);
+
+	return ready;
+}
+
+/* print the reports in order
+ * if wait is false stop at the first analysis not yet done */
+static void report_flush(bool wait)
+{
+	while (Reports && (wait || report_ready()))
+	{
+		report_t *report = Reports;
+
+		prompt_end();
+		printf("%s", report->text);
+		if (report->job)
+		{
+			char *text = analysis_wait(report->job);
+
+			printf("%s", text ? text : "");
+			free(text);
+		}
+
+		Reports = report->next;
+		if (NULL == Reports)
+			Reports_tail = &Reports;
+		free(report->text);
+		free(report);
+	}
+
+	fflush(stdout);
+}
+
+/* drop the reports not printed, the analyses still running are freed by
+ * the workers, see analysis_discard() */
+static void report_discard(void)
+{
+	pthread_mutex_lock(&Analysis_mutex);
+	while (Reports)
+	{
+		report_t *report = Reports;
+		analysis_job_t *job = report->job;
+
+		if (job && job->done)
+		{
+			free(job->text);
+			free(job);
+		}
+		else if (job)
+			job->abandoned = true;
+
+		Reports = report->next;
+		free(report->text);
+		free(report);
+	}
+	Reports_tail = &Reports;
+	pthread_mutex_unlock(&Analysis_mutex);
+}
+
+/* one shot list of readers and cards using a machine readable format
+ * No PnP detection, no spinner, no sleep, only one SCardGetStatusChange()
+ * Return a sysexits.h code */
+static int snapshot(FILE *out, long long start)
+{
+	SCARDCONTEXT hContext2;
+	SCARD_READERSTATE *states = NULL;
+	char buffer[4096];
+	LPSTR mszReaders = buffer;
+	DWORD dwReaders = sizeof buffer;
+	char (*atrs)[MAX_ATR_SIZE*3+1] = NULL;
+	const char **present = NULL;
+	char **descriptions = NULL;
+	int nbReaders = 0, ret = EX_OK;
+	char *ptr;
+	LONG rv;
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext2);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		print_pcsc_error("SCardEstablishContext", rv);
+		return EX_UNAVAILABLE;
+	}
+
+	/* a static buffer avoids a second call in the usual case */
+	rv = SCardListReaders(hContext2, NULL, mszReaders, &dwReaders);
+	if (SCARD_E_INSUFFICIENT_BUFFER == rv)
+	{
+		rv = SCardListReaders(hContext2, NULL, NULL, &dwReaders);
+		if (SCARD_S_SUCCESS == rv)
+		{
+			mszReaders = malloc(dwReaders);
+			if (NULL == mszReaders)
+			{
+				fprintf(stderr, "%s: malloc: not enough memory\n", Options.pname);
+				exit(EX_OSERR);
+			}
+			rv = SCardListReaders(hContext2, NULL, mszReaders, &dwReaders);
+		}
+	}
+
+	if (SCARD_E_NO_READERS_AVAILABLE == rv)
+	{
+		*mszReaders = '\0';
+		rv = SCARD_S_SUCCESS;
+	}
+
+	if (rv != SCARD_S_SUCCESS)
+	{
+		print_pcsc_error("SCardListReaders", rv);
+		ret = SCARD_E_NO_SERVICE == rv ? EX_UNAVAILABLE : EX_SOFTWARE;
+		goto end;
+	}
+
+	for (ptr = mszReaders; *ptr != '\0'; ptr += strlen(ptr)+1)
+		if (reader_selected(ptr))
+			nbReaders++;
+
+	states = calloc(nbReaders+1, sizeof *states);
+	atrs = calloc(nbReaders+1, sizeof *atrs);
+	present = calloc(nbReaders+1, sizeof *present);
+	descriptions = calloc(nbReaders+1, sizeof *descriptions);
+	if (NULL == states || NULL == atrs || NULL == present
+		|| NULL == descriptions)
+	{
+		fprintf(stderr, "%s: Not enough memory for readers states\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	nbReaders = 0;
+	for (ptr = mszReaders; *ptr != '\0'; ptr += strlen(ptr)+1)
+		if (reader_selected(ptr))
+		{
+			states[nbReaders].szReader = ptr;
+			states[nbReaders].dwCurrentState = SCARD_STATE_UNAWARE;
+			states[nbReaders].cbAtr = sizeof states[nbReaders].rgbAtr;
+			nbReaders++;
+		}
+
+	if (nbReaders)
+	{
+		/* do not wait: just get the current states */
+		rv = SCardGetStatusChange(hContext2, 0, states, nbReaders);
+		if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
+		{
+			print_pcsc_error("SCardGetStatusChange", rv);
+			ret = EX_SOFTWARE;
+			goto end;
+		}
+	}
+	else
+		ret = EX_NOINPUT;
+
+	/* ATRs of the selected cards */
+	for (int i=0; i<nbReaders; i++)
+	{
+		if (!(states[i].dwEventState & SCARD_STATE_PRESENT)
+			|| 0 == states[i].cbAtr)
+			continue;
+
+		atr_to_string(states[i].rgbAtr, states[i].cbAtr, atrs[i]);
+		if (atr_selected(atrs[i]))
+			present[i] = atrs[i];
+	}
+
+	if (Options.analyse_atr)
+		identify_cards(present, descriptions, nbReaders);
+
+	fprintf(out, "readers: %d\n", nbReaders);
+	for (int i=0; i<nbReaders; i++)
+	{
+		DWORD state = states[i].dwEventState;
+
+		fprintf(out, "reader %d: %s\n", i, states[i].szReader);
+		fprintf(out, "reader %d event: %d\n", i, (int)(state >> 16));
+		fprintf(out, "reader %d state:", i);
+		/* CHANGED is not a state */
+		for (int b=0; b<11; b++)
+			if ((state & (1 << b)) && (1 << b) != SCARD_STATE_CHANGED)
+				fprintf(out, " %s", State_names[b]);
+		fprintf(out, "\n");
+
+		if (NULL == present[i])
+			continue;
+
+		fprintf(out, "reader %d atr: %s\n", i, present[i]);
+		for (ptr = descriptions[i]; ptr && *ptr; ptr = strchr(ptr, '\n') + 1)
+			fprintf(out, "reader %d card: %.*s\n", i,
+				(int)strcspn(ptr, "\n"), ptr);
+		free(descriptions[i]);
+	}
+
+end:
+	(void)SCardReleaseContext(hContext2);
+	fprintf(out, "elapsed: %.3f ms\n", (monotonic_us() - start) / 1000.);
+
+	free(states);
+	free(atrs);
+	free(present);
+	free(descriptions);
+	if (mszReaders != buffer)
+		free(mszReaders);
+
+	return ret;
+}
+
+static int compare_long_long(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* measure the duration of count snapshots */
+static int benchmark(int count)
+{
+	long long *durations, total = 0;
+	int ret = EX_OK, done = 0;
+#ifdef WIN32
+	FILE *null = fopen("NUL", "w");
+#else
+	FILE *null = fopen("/dev/null", "w");
+#endif
+
+	durations = calloc(count, sizeof *durations);
+	if (NULL == durations || NULL == null)
+	{
+		fprintf(stderr, "%s: benchmark initialisation failed\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	/* stop at the first failed snapshot (no reader, etc.) */
+	for (done=0; done<count; done++)
+	{
+		long long start = monotonic_us();
+
+		ret = snapshot(null, start);
+		if (ret != EX_OK)
+			break;
+
+		durations[done] = monotonic_us() - start;
+		total += durations[done];
+	}
+	fclose(null);
+
+	/* statistics of the completed snapshots only */
+	if (done > 0)
+	{
+		qsort(durations, done, sizeof *durations, compare_long_long);
+		printf("snapshots: %d\n", done);
+		printf("min: %.3f ms\n", durations[0] / 1000.);
+		printf("median: %.3f ms\n", durations[done / 2] / 1000.);
+		printf("p90: %.3f ms\n", durations[done * 9 / 10] / 1000.);
+		printf("max: %.3f ms\n", durations[done - 1] / 1000.);
+		printf("mean: %.3f ms\n", total / 1000. / done);
+	}
+	free(durations);
+
+	return ret;
+}
+
+/* notification fan-out benchmark (-N clients)
+ * Each client thread uses its own context and waits for the card events
+ * on all the selected readers. The same event is identified by the reader
+ * and the event counter (upper 16 bits of dwEventState) or, if the
+ * counter is not available, by the rank of the card movement. */
+typedef struct
+{
+	int reader;
+	int event;
+	int client;
+	long long ns;	/* time the client saw the event, 0 for the initial state */
+} fanout_event_t;
+
+typedef struct
+{
+	int id;
+	SCARDCONTEXT context;
+	pthread_t thread;
+	_Atomic bool done;
+	fanout_event_t *events;
+	int nb_events;
+	int size;
+} fanout_client_t;
+
+#define FANOUT_GRACE_MS 500
+
+static const char **Fanout_readers = NULL;
+static int Nb_fanout_readers = 0;
+static _Atomic bool Fanout_stop = false;
+static int Fanout_ready = 0;
+static pthread_mutex_t Fanout_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Fanout_cond = PTHREAD_COND_INITIALIZER;
+
+static void fanout_set_ready(void)
+{
+	pthread_mutex_lock(&Fanout_mutex);
+	Fanout_ready++;
+	pthread_cond_signal(&Fanout_cond);
+	pthread_mutex_unlock(&Fanout_mutex);
+}
+
+static void fanout_record(fanout_client_t *client, int reader, int event,
+	long long ns)
+{
+	if (client->nb_events == client->size)
+	{
+		client->size = client->size ? client->size * 2 : 64;
+		client->events = xrealloc(client->events,
+			client->size * sizeof *client->events);
+	}
+
+	client->events[client->nb_events].reader = reader;
+	client->events[client->nb_events].event = event;
+	client->events[client->nb_events].client = client->id;
+	client->events[client->nb_events].ns = ns;
+	client->nb_events++;
+}
+
+static void *fanout_client(void *arg)
+{
+	fanout_client_t *client = arg;
+	SCARD_READERSTATE *states;
+	int *ranks;
+	LONG rv;
+
+	states = calloc(Nb_fanout_readers, sizeof *states);
+	ranks = calloc(Nb_fanout_readers, sizeof *ranks);
+	if (NULL == states || NULL == ranks)
+	{
+		fprintf(stderr, "%s: Not enough memory for readers states\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	for (int i=0; i<Nb_fanout_readers; i++)
+	{
+		states[i].szReader = Fanout_readers[i];
+		states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+	}
+
+	/* initial states */
+	rv = SCardGetStatusChange(client->context, 0, states, Nb_fanout_readers);
+	if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
+	{
+		print_pcsc_error("SCardGetStatusChange", rv);
+		Fanout_stop = true;
+	}
+	/* the initial states are recorded with a time of 0 so that the events
+	 * already seen by some clients when the others started are ignored */
+	for (int i=0; i<Nb_fanout_readers; i++)
+	{
+		states[i].dwCurrentState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+		fanout_record(client, i, states[i].dwCurrentState >> 16, 0);
+	}
+	fanout_set_ready();
+
+	while (! Fanout_stop)
+	{
+		rv = SCardGetStatusChange(client->context, TIMEOUT, states,
+			Nb_fanout_readers);
+		long long now = monotonic_ns();
 
-			case 'p':
-				options->pnp = true;
-				break;
+		if (SCARD_E_TIMEOUT == rv)
+			continue;
 
-			case 'h':
-				usage(pname);
-				exit(EX_OK);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			if (rv != SCARD_E_CANCELLED)
+				print_pcsc_error("SCardGetStatusChange", rv);
+			break;
+		}
 
-			case 'd':
-				options->debug = true;
-				break;
+		for (int i=0; i<Nb_fanout_readers; i++)
+		{
+			DWORD old = states[i].dwCurrentState;
+			DWORD new = states[i].dwEventState & ~SCARD_STATE_CHANGED;
 
-			default:
-				usage(pname);
-				exit(EX_USAGE);
+			/* ignore the other changes (INUSE, EXCLUSIVE, etc.) */
+			if ((new >> 16) != (old >> 16)
+				|| (new ^ old) & (SCARD_STATE_PRESENT | SCARD_STATE_EMPTY))
+			{
+				ranks[i]++;
+				fanout_record(client, i, (new >> 16) ? (int)(new >> 16) : ranks[i],
+					now);
+			}
+			states[i].dwCurrentState = new;
 		}
 	}
-	if (argc - optind != 0)
+
+	free(states);
+	free(ranks);
+	client->done = true;
+
+	return NULL;
+}
+
+#ifdef __linux__
+/* CPU time (user + system) used by pcscd in ms, or -1 */
+static double pcscd_cpu_ms(void)
+{
+	DIR *dir = opendir("/proc");
+	struct dirent *entry;
+	double ms = -1;
+
+	if (NULL == dir)
+		return -1;
+
+	while (ms < 0 && (entry = readdir(dir)) != NULL)
 	{
-		fprintf(stderr, "%s error: superfluous arguments: %s\n", pname, argv[optind]);
-		usage(pname);
-		exit(EX_USAGE);
+		char path[300], line[1024], *p;
+		unsigned long utime, stime;
+		FILE *f;
+
+		if (! isdigit((unsigned char)entry->d_name[0]))
+			continue;
+
+		snprintf(path, sizeof path, "/proc/%s/comm", entry->d_name);
+		f = fopen(path, "r");
+		if (NULL == f)
+			continue;
+		p = fgets(line, sizeof line, f);
+		fclose(f);
+		if (NULL == p || strcmp(line, "pcscd\n"))
+			continue;
+
+		snprintf(path, sizeof path, "/proc/%s/stat", entry->d_name);
+		f = fopen(path, "r");
+		if (NULL == f)
+			continue;
+		p = fgets(line, sizeof line, f);
+		fclose(f);
+
+		/* utime and stime are the fields 14 and 15 */
+		if (p && (p = strrchr(line, ')')) != NULL
+			&& 2 == sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime))
+			ms = (utime + stime) * 1000. / sysconf(_SC_CLK_TCK);
 	}
-	return EX_OK;
+	closedir(dir);
+
+	return ms;
 }
+#endif
 
-static LONG stress(SCARDCONTEXT hContext2, const char *readerName)
+static int compare_fanout_event(const void *a, const void *b)
 {
-	LONG rv, ret_rv = SCARD_S_SUCCESS;
-	SCARDHANDLE hCard;
-	DWORD dwActiveProtocol;
-	const SCARD_IO_REQUEST *pioSendPci;
+	const fanout_event_t *x = a, *y = b;
 
-	printf("Stress card in reader: %s\n\n", readerName);
-	rv = SCardConnect(hContext2, readerName, SCARD_SHARE_SHARED,
-			SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &hCard, &dwActiveProtocol);
+	if (x->reader != y->reader)
+		return x->reader - y->reader;
+	if (x->event != y->event)
+		return x->event - y->event;
+	return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+static void print_distribution(const char *name, long long *values, int count)
+{
+	if (0 == count)
+		return;
+
+	qsort(values, count, sizeof *values, compare_long_long);
+	printf("%s min: %.3f ms\n", name, values[0] / 1e6);
+	printf("%s median: %.3f ms\n", name, values[count / 2] / 1e6);
+	printf("%s p90: %.3f ms\n", name, values[count * 9 / 10] / 1e6);
+	printf("%s p99: %.3f ms\n", name, values[count * 99 / 100] / 1e6);
+	printf("%s max: %.3f ms\n", name, values[count - 1] / 1e6);
+}
+
+/* wait for the card events using count clients and report the delay
+ * between the first client and the others */
+static int fanout(int count)
+{
+	SCARDCONTEXT hContext2;
+	fanout_client_t *clients;
+	fanout_event_t *events = NULL;
+	long long *latencies, *spreads;
+	int nb_events = 0, nb_latencies = 0, nb_spreads = 0, missed = 0;
+	LPSTR mszReaders = NULL;
+	DWORD dwReaders = 0;
+	int ret = EX_OK;
+	LONG rv;
+
+	initialize_signal_handlers();
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext2);
 	if (rv != SCARD_S_SUCCESS)
 	{
-		print_pcsc_error("SCardConnect", rv);
-		return rv;
+		print_pcsc_error("SCardEstablishContext", rv);
+		return EX_UNAVAILABLE;
 	}
 
-	/* Select Master File */
-	BYTE pbSendBuffer[] = {0, 0xA4, 0, 0, 2, 0x3F, 0};
-	BYTE pbRecvBuffer[256+2];
-	DWORD dwSendLength, dwRecvLength;
-	struct timeval time_start, time_end;
-
-	switch (dwActiveProtocol)
+	rv = SCardListReaders(hContext2, NULL, NULL, &dwReaders);
+	if (SCARD_S_SUCCESS == rv)
 	{
-		case SCARD_PROTOCOL_T0:
-			pioSendPci = SCARD_PCI_T0;
-			break;
-		case SCARD_PROTOCOL_T1:
-			pioSendPci = SCARD_PCI_T1;
-			break;
-		case SCARD_PROTOCOL_RAW:
-			pioSendPci = SCARD_PCI_RAW;
-			break;
-		default:
-			fprintf(stderr, "Unknown protocol\n");
-			return -1;
+		mszReaders = xrealloc(NULL, dwReaders);
+		rv = SCardListReaders(hContext2, NULL, mszReaders, &dwReaders);
+	}
+	if (rv != SCARD_S_SUCCESS)
+	{
+		if (rv != SCARD_E_NO_READERS_AVAILABLE)
+			print_pcsc_error("SCardListReaders", rv);
+		(void)SCardReleaseContext(hContext2);
+		free(mszReaders);
+		return SCARD_E_NO_READERS_AVAILABLE == rv ? EX_NOINPUT : EX_SOFTWARE;
 	}
 
-	gettimeofday(&time_start, NULL);
+	for (char *ptr = mszReaders; *ptr != '\0'; ptr += strlen(ptr)+1)
+		if (reader_selected(ptr))
+		{
+			Fanout_readers = xrealloc(Fanout_readers,
+				(Nb_fanout_readers + 1) * sizeof *Fanout_readers);
+			Fanout_readers[Nb_fanout_readers++] = ptr;
+		}
 
+	if (0 == Nb_fanout_readers)
+	{
+		fprintf(stderr, "%s: no reader selected\n", Options.pname);
+		(void)SCardReleaseContext(hContext2);
+		free(mszReaders);
+		return EX_NOINPUT;
+	}
 
-#define COUNT 100
-	int count;
-	for (count=0; count<COUNT; count++)
+	clients = calloc(count, sizeof *clients);
+	if (NULL == clients)
 	{
-		printf("%sFAPDU n°: %d\n", cpl, count);
-		dwSendLength = sizeof(pbSendBuffer);
-		dwRecvLength = sizeof(pbRecvBuffer);
-		rv = SCardTransmit(hCard, pioSendPci, pbSendBuffer, dwSendLength,
-			NULL, pbRecvBuffer, &dwRecvLength);
+		fprintf(stderr, "%s: Not enough memory for clients\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	int started;
+	for (started=0; started<count; started++)
+	{
+		fanout_client_t *client = &clients[started];
+
+		client->id = started;
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+			&client->context);
 		if (rv != SCARD_S_SUCCESS)
 		{
-			print_pcsc_error("SCardTransmit", rv);
-			ret_rv = rv;
+			print_pcsc_error("SCardEstablishContext", rv);
+			ret = EX_UNAVAILABLE;
 			break;
 		}
 
-		if (Interrupted)
-			exit(EX_OSERR);
+		if (pthread_create(&client->thread, NULL, fanout_client, client))
+		{
+			perror("pthread_create");
+			(void)SCardReleaseContext(client->context);
+			ret = EX_OSERR;
+			break;
+		}
 	}
 
-	gettimeofday(&time_end, NULL);
-	struct timeval r;
-	r.tv_sec = time_end.tv_sec - time_start.tv_sec;
-	r.tv_usec = time_end.tv_usec - time_start.tv_usec;
-	if (r.tv_usec < 0)
+	/* wait for all the clients to have their initial states */
+	pthread_mutex_lock(&Fanout_mutex);
+	while (Fanout_ready < started)
+		pthread_cond_wait(&Fanout_cond, &Fanout_mutex);
+	pthread_mutex_unlock(&Fanout_mutex);
+
+#ifdef __linux__
+	double cpu_start = pcscd_cpu_ms();
+#endif
+
+	if (EX_OK == ret && ! Fanout_stop)
 	{
-		r.tv_sec--;
-		r.tv_usec += 1000000;
+		printf("%d clients waiting on %d reader(s). Insert or remove cards, Ctrl-C to stop.\n",
+			started, Nb_fanout_readers);
+		fflush(stdout);
+		while (! should_exit() && ! Fanout_stop)
+			usleep(100 * 1000);
 	}
-	long delta = r.tv_sec * 1000000 + r.tv_usec;
-	printf("Total time: %ld µs\n", delta);
-	if (0 == count)
-		count = 1;
-	printf("%f APDU/s\n", 1000000. / (delta / count));
 
-	rv = SCardDisconnect(hCard, SCARD_UNPOWER_CARD);
-	if (rv != SCARD_S_SUCCESS)
+	/* let the clients see the events started before the end */
+	long long stop_ns = monotonic_ns();
+	if (EX_OK == ret)
+		usleep(FANOUT_GRACE_MS * 1000);
+
+	/* SCardCancel() is lost if the client is not waiting yet */
+	Fanout_stop = true;
+	for (int i=0; i<started; i++)
 	{
-		print_pcsc_error("SCardDisconnect", rv);
-		ret_rv = rv;
+		while (! clients[i].done)
+		{
+			(void)SCardCancel(clients[i].context);
+			usleep(10 * 1000);
+		}
+		pthread_join(clients[i].thread, NULL);
+		(void)SCardReleaseContext(clients[i].context);
 	}
 
-	return ret_rv;
-}
+#ifdef __linux__
+	double cpu_end = pcscd_cpu_ms();
+#endif
 
-static void print_readers(const char **readers, int nbReaders)
-{
-	int i = 0;
-	for (i = 0;i < nbReaders; i++)
+	/* group the events seen by the clients */
+	for (int i=0; i<started; i++)
 	{
-		printf("%s%d: %s%s\n", blue, i, readers[i], color_end);
+		events = xrealloc(events,
+			(nb_events + clients[i].nb_events + 1) * sizeof *events);
+		memcpy(events + nb_events, clients[i].events,
+			clients[i].nb_events * sizeof *events);
+		nb_events += clients[i].nb_events;
+		free(clients[i].events);
 	}
-}
+	qsort(events, nb_events, sizeof *events, compare_fanout_event);
 
-static void displayChangedStatus(SCARD_READERSTATE rgReaderStates[], int count)
-{
-	char state_bits[][sizeof "UNAVAILABLE"] = {
-		"IGNORE",		/* 0x0001 */
-		"CHANGED",		/* 0x0002 */
-		"UNKNOWN",		/* 0x0004 */
-		"UNAVAILABLE",	/* 0x0008 */
-		"EMPTY",		/* 0x0010 */
-		"PRESENT",		/* 0x0020 */
-		"ATRMATCH",		/* 0x0040 */
-		"EXCLUSIVE",	/* 0x0080 */
-		"INUSE",		/* 0x0100 */
-		"MUTE",			/* 0x0200 */
-		"UNPOWERED"		/* 0x0400 */
-	};
-	printf("\n");
-	for (int i=0; i<count; i++)
+	latencies = calloc(nb_events + 1, sizeof *latencies);
+	spreads = calloc(nb_events + 1, sizeof *spreads);
+	if (NULL == latencies || NULL == spreads)
 	{
-		SCARD_READERSTATE r = rgReaderStates[i];
-		printf("%d: %s, %d, 0x%04X -> 0x%04X",
-			i,
-			r.szReader,
-			(int)(r.dwEventState >> 16),
-			(int)(r.dwCurrentState & 0xFFFF),
-			(int)(r.dwEventState & 0xFFFF));
-		for (int b=0; b<11; b++)
-		{
-			int v = 1 << b;
-			if ((r.dwEventState & v) && (r.dwCurrentState & v))
-				printf(" =%s", state_bits[b]);
-			if ((r.dwEventState & v) && !(r.dwCurrentState & v))
-				printf(" %s+%s%s", blue, state_bits[b], color_end);
-			if (!(r.dwEventState & v) && (r.dwCurrentState & v))
-				printf(" %s-%s%s", red, state_bits[b], color_end);
-		}
+		fprintf(stderr, "%s: Not enough memory for events\n", Options.pname);
+		exit(EX_OSERR);
+	}
+
+	for (int i=0, j; i<nb_events; i=j)
+	{
+		for (j=i+1; j<nb_events && events[j].reader == events[i].reader
+			&& events[j].event == events[i].event; j++)
+			;
+
+		/* initial state of at least one client, or too late */
+		if (0 == events[i].ns || events[i].ns > stop_ns)
+			continue;
+
+		for (int k=i+1; k<j; k++)
+			latencies[nb_latencies++] = events[k].ns - events[i].ns;
+		spreads[nb_spreads++] = events[j-1].ns - events[i].ns;
+		missed += started - (j - i);
+	}
+
+	printf("clients: %d\n", started);
+	printf("readers: %d\n", Nb_fanout_readers);
+	printf("events: %d\n", nb_spreads);
+	printf("missed notifications: %d\n", missed);
+	print_distribution("latency", latencies, nb_latencies);
+	print_distribution("spread", spreads, nb_spreads);
+#ifdef __linux__
+	if (cpu_start >= 0 && cpu_end >= 0)
+	{
+		printf("pcscd CPU: %.0f ms", cpu_end - cpu_start);
+		if (nb_spreads)
+			printf(" (%.3f ms per event)", (cpu_end - cpu_start) / nb_spreads);
 		printf("\n");
 	}
+#endif
+
+	free(latencies);
+	free(spreads);
+	free(events);
+	free(clients);
+	free(Fanout_readers);
+	free(mszReaders);
+	(void)SCardReleaseContext(hContext2);
+
+	return ret;
 }
 
 int main(int argc, char *argv[])
@@ -526,15 +3569,21 @@ int main(int argc, char *argv[])
 #endif
 	int ret_val = EX_OK;
 	SCARD_READERSTATE *rgReaderStates_t = NULL;
+	reader_data_t *readers_data = NULL;
 	SCARD_READERSTATE rgReaderStates[1] = { 0, };
 	DWORD dwReaders = 0, dwReadersOld;
 	LPSTR mszReaders = NULL;
 	char *ptr = NULL;
 	const char **readers = NULL;
-	int nbReaders, i;
+	int nbReaders = 0, i;
+	int suppressed;	/* transitions of the readers reported */
+	int nb_reported;	/* readers whose event is printed */
 	char atr[MAX_ATR_SIZE*3+1];	/* ATR in ASCII */
 	char atr_command[sizeof(atr)+sizeof(ATR_PARSER)+2+1];
 	pthread_t spin_pthread = pthread_self();
+	long long start_us = monotonic_us();
+	bool pipeline;	/* use the ordered reporting stage */
+	FILE *out = stdout;
 
 	start_time = time(NULL);
 	initialize_terminal();
@@ -542,13 +3591,39 @@ int main(int argc, char *argv[])
 	{
 		exit(EX_USAGE);
 	}
+
+	/* the stress mode needs the card just after its report */
+	pipeline = Options.analyse_atr && Options.workers > 1 && ! Options.stress_card;
+#ifdef WIN32
+	pipeline = false;
+#endif
+
+	if (Options.benchmark)
+		return benchmark(Options.benchmark);
+
+	if (Options.fanout)
+		return fanout(Options.fanout);
+
+	if (Options.snapshot)
+	{
+		ret_val = snapshot(stdout, start_us);
+		free_filters();
+		return ret_val;
+	}
+
 	print_version();
 
 	initialize_signal_handlers();
+	Stats_start_us = monotonic_us();
+	Next_stats_us = Stats_start_us + Options.stats_interval * 1000000LL;
 
 	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
 	test_rv("SCardEstablishContext", rv, end2);
 
+	/* no need to detect PnP support if we do not wait for readers */
+	if (Options.only_list_cards || Options.only_list_readers)
+		goto get_readers;
+
 	rgReaderStates[0].szReader = "\\\\?PnP?\\Notification";
 	rgReaderStates[0].dwCurrentState = SCARD_STATE_UNAWARE;
 
@@ -573,6 +3648,11 @@ int main(int argc, char *argv[])
 	}
 
 get_readers:
+	prompt_end();
+
+	/* the reports of the previous list of readers */
+	report_flush(true);
+
 	/* free memory possibly allocated in a previous loop */
 	if (NULL != readers)
 	{
@@ -586,6 +3666,13 @@ get_readers:
 		rgReaderStates_t = NULL;
 	}
 
+	if (NULL != readers_data)
+	{
+		analysis_discard(readers_data, nbReaders);
+		free(readers_data);
+		readers_data = NULL;
+	}
+
 	/* Retrieve the available readers list.
 	 *
 	 * 1. Call with a null buffer to get the number of bytes to allocate
@@ -617,13 +3704,14 @@ get_readers:
 	rv = SCardListReaders(hContext, NULL, mszReaders, &dwReaders);
 
 	/* Extract readers from the null separated string and get the total
-	 * number of readers */
+	 * number of selected readers */
 	nbReaders = 0;
 	ptr = mszReaders;
 	while (*ptr != '\0')
 	{
+		if (reader_selected(ptr))
+			nbReaders++;
 		ptr += strlen(ptr)+1;
-		nbReaders++;
 	}
 
 	if (SCARD_E_NO_READERS_AVAILABLE == rv || 0 == nbReaders)
@@ -647,6 +3735,16 @@ get_readers:
 			do
 			{
 				rv = SCardGetStatusChange(hContext, TIMEOUT, rgReaderStates, 1);
+				rv = stats_wakeup(rv, rgReaderStates, 1);
+
+				if (SCARD_E_TIMEOUT == rv && stats_due())
+				{
+					spin_stop();
+					print_stats();
+					printf("\n%sWaiting for the first reader...%s   ", red,
+						color_end);
+					spin_start();
+				}
 			}
 			while (SCARD_E_TIMEOUT == rv);
 
@@ -703,9 +3801,12 @@ get_readers:
 	ptr = mszReaders;
 	while (*ptr != '\0')
 	{
-		readers[nbReaders] = ptr;
+		if (reader_selected(ptr))
+		{
+			readers[nbReaders] = ptr;
+			nbReaders++;
+		}
 		ptr += strlen(ptr)+1;
-		nbReaders++;
 	}
 
 	if (! Options.only_list_cards)
@@ -718,7 +3819,8 @@ get_readers:
 
 	/* allocate the ReaderStates table */
 	rgReaderStates_t = calloc(nbReaders+1, sizeof(* rgReaderStates_t));
-	if (NULL == rgReaderStates_t)
+	readers_data = calloc(nbReaders+1, sizeof(* readers_data));
+	if (NULL == rgReaderStates_t || NULL == readers_data)
 	{
 		fprintf(stderr, "%s: Not enough memory for readers states\n", Options.pname);
 		(void)SCardReleaseContext(hContext);
@@ -733,6 +3835,7 @@ get_readers:
 		rgReaderStates_t[i].szReader = readers[i];
 		rgReaderStates_t[i].dwCurrentState = SCARD_STATE_UNAWARE;
 		rgReaderStates_t[i].cbAtr = sizeof rgReaderStates_t[i].rgbAtr;
+		readers_data[i].debounce_ms = debounce_window(readers[i]);
 	}
 
 	/* If Plug and Play is supported by the PC/SC layer */
@@ -740,6 +3843,7 @@ get_readers:
 	{
 		rgReaderStates_t[nbReaders].szReader = "\\\\?PnP?\\Notification";
 		rgReaderStates_t[nbReaders].dwCurrentState = SCARD_STATE_UNKNOWN;
+		readers_data[nbReaders].is_pnp = true;
 		nbReaders++;
 	}
 
@@ -747,20 +3851,29 @@ get_readers:
 	int oldNbReaders;
 	int oldNbReaders_init = false;
 #endif
-	spin_start();
+	if (! Options.only_list_cards)
+		spin_start();
 
 	/* Wait endlessly for all events in the list of readers
 	 * We only stop in case of an error
 	 */
 	rv = SCardGetStatusChange(hContext, TIMEOUT, rgReaderStates_t, nbReaders);
+	rv = stats_wakeup(rv, rgReaderStates_t, nbReaders);
 
-	if (rv != SCARD_S_SUCCESS)
+	if (Options.debounce && SCARD_S_SUCCESS == rv)
+		rv = debounce(hContext, rgReaderStates_t, readers_data, nbReaders);
+
+	if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
 	{
 		/* something bad happened. We need to exit */
 		Interrupted = true;
 	}
 
-	spin_stop();
+	if (! Options.only_list_cards)
+		spin_stop();
+
+	if (stats_due())
+		print_stats();
 
 	if (Options.debug)
 		displayChangedStatus(rgReaderStates_t, nbReaders);
@@ -797,126 +3910,188 @@ get_readers:
 			}
 		}
 
-		if (rv != SCARD_E_TIMEOUT)
+		/* an event of readers or cards not selected prints nothing */
+		nb_reported = suppressed = 0;
+		for (i=0; i<nbReaders; i++)
+		{
+			readers_data[i].reported = event_reported(&rgReaderStates_t[i],
+				&readers_data[i]);
+			if (readers_data[i].reported)
+			{
+				nb_reported++;
+				suppressed += readers_data[i].suppressed;
+			}
+		}
+
+		if (pipeline)
+			out = report_open();
+
+		if (nb_reported)
 		{
+			if (! pipeline)
+				prompt_end();
+
 			/* Timestamp the event as we get notified */
 			t = time(NULL);
-			printf("\n%s", ctime(&t));
+			fprintf(out, "\n%s", ctime(&t));
+
+			if (suppressed)
+				fprintf(out, " Debounce: %s%d%s transition(s) suppressed\n",
+					magenta, suppressed, color_end);
+		}
+
+		/* start the analysis of all the inserted cards now so they are
+		 * done in parallel and not one after the other */
+		if (Options.analyse_atr && Options.workers > 1)
+		{
+			for (i=0; i<nbReaders; i++)
+			{
+				SCARD_READERSTATE *state = &rgReaderStates_t[i];
+
+				if (! readers_data[i].reported || 0 == state->cbAtr)
+					continue;
+
+				readers_data[i].analysis = analysis_submit(state->rgbAtr,
+					state->cbAtr);
+			}
 		}
 
 		/* Now we have an event, check all the readers in the list to see what
 		 * happened */
 		for (current_reader=0; current_reader < nbReaders; current_reader++)
 		{
-#if defined(__APPLE__) || defined(WIN32)
-			if (rgReaderStates_t[current_reader].dwCurrentState ==
-				rgReaderStates_t[current_reader].dwEventState)
-				continue;
-#endif
-
 			/* The new current state is now the old event state */
 			rgReaderStates_t[current_reader].dwCurrentState =
 				rgReaderStates_t[current_reader].dwEventState;
 
-			if (! (rgReaderStates_t[current_reader].dwEventState &
-				SCARD_STATE_CHANGED))
-				/* If nothing changed then skip to the next reader */
+			/* If nothing changed, or the card is not selected, then skip
+			 * to the next reader */
+			if (! readers_data[current_reader].reported)
 				continue;
 
-			/* From here we know that the state for the current reader has
-			 * changed because we did not pass through the continue statement
-			 * above.
-			 */
+			if (! readers_data[current_reader].is_pnp)
+				stats_update(rgReaderStates_t[current_reader].szReader,
+					rgReaderStates_t[current_reader].dwEventState);
 
 			/* Specify the current reader's number and name */
-			printf(" Reader %d: %s%s%s\n", current_reader,
+			fprintf(out, " Reader %d: %s%s%s\n", current_reader,
 				magenta, rgReaderStates_t[current_reader].szReader,
 				color_end);
 
 			/* Event number */
-			printf("  Event number: %s%d%s\n", magenta,
+			fprintf(out, "  Event number: %s%d%s\n", magenta,
 				(int)(rgReaderStates_t[current_reader].dwEventState >> 16),
 				color_end);
 
+			if (readers_data[current_reader].suppressed)
+				fprintf(out, "  Suppressed transitions: %s%d%s\n", magenta,
+					readers_data[current_reader].suppressed, color_end);
+			readers_data[current_reader].suppressed = 0;
+
 			/* Dump the full current state */
-			printf("  Card state: %s", red);
+			fprintf(out, "  Card state: %s", red);
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_IGNORE)
-				printf("Ignore this reader, ");
+				fprintf(out, "Ignore this reader, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_UNKNOWN)
 			{
-				printf("Unknown\n");
+				fprintf(out, "Unknown\n");
+				if (pipeline)
+					report_add(out, NULL);
 				goto get_readers;
 			}
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_UNAVAILABLE)
-				printf("Status unavailable, ");
+				fprintf(out, "Status unavailable, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_EMPTY)
-				printf("Card removed, ");
+				fprintf(out, "Card removed, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_PRESENT)
-				printf("Card inserted, ");
+				fprintf(out, "Card inserted, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_ATRMATCH)
-				printf("ATR matches card, ");
+				fprintf(out, "ATR matches card, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_EXCLUSIVE)
-				printf("Exclusive Mode, ");
+				fprintf(out, "Exclusive Mode, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_INUSE)
-				printf("Shared Mode, ");
+				fprintf(out, "Shared Mode, ");
 
 			if (rgReaderStates_t[current_reader].dwEventState &
 				SCARD_STATE_MUTE)
-				printf("Unresponsive card, ");
+				fprintf(out, "Unresponsive card, ");
 
-			printf("%s\n", color_end);
+			fprintf(out, "%s\n", color_end);
 
 			/* force display */
-			fflush(stdout);
+			fflush(out);
 
 			/* Also dump the ATR if available */
 			if (rgReaderStates_t[current_reader].cbAtr > 0)
 			{
-				printf("  ATR: ");
-
-				if (rgReaderStates_t[current_reader].cbAtr)
-				{
-					unsigned int j;
+				fprintf(out, "  ATR: ");
 
-					for (j=0; j<rgReaderStates_t[current_reader].cbAtr; j++)
-						sprintf(&atr[j*3], "%02X ",
-							rgReaderStates_t[current_reader].rgbAtr[j]);
+				atr_to_string(rgReaderStates_t[current_reader].rgbAtr,
+					rgReaderStates_t[current_reader].cbAtr, atr);
 
-					atr[j*3-1] = '\0';
-				}
-				else
-					atr[0] = '\0';
-
-				printf("%s%s%s\n", magenta, atr, color_end);
+				fprintf(out, "%s%s%s\n", magenta, atr, color_end);
 
 				/* force display */
-				fflush(stdout);
+				fflush(out);
 
 				if (Options.analyse_atr)
 				{
-					printf("\n");
-
-					sprintf(atr_command, ATR_PARSER " '%s'", atr);
-					if (system(atr_command))
-						perror(atr_command);
-
-					printf("\n");
+					char *text = NULL;
+
+					fprintf(out, "\n");
+
+					/* printed by the reporting stage once done */
+					if (pipeline && readers_data[current_reader].analysis)
+					{
+						report_add(out, readers_data[current_reader].analysis);
+						readers_data[current_reader].analysis = NULL;
+						out = report_open();
+					}
+					else
+					{
+						/* already started by a worker */
+						if (readers_data[current_reader].analysis)
+						{
+							text = analysis_wait(readers_data[current_reader].analysis);
+							readers_data[current_reader].analysis = NULL;
+						}
+#ifndef WIN32
+						/* use the identification service if available */
+						else
+							text = atr_service_query(ATR_SERVICE_DECODE,
+								rgReaderStates_t[current_reader].rgbAtr,
+								rgReaderStates_t[current_reader].cbAtr, NULL);
+#endif
+						if (text)
+						{
+							printf("%s", text);
+							free(text);
+						}
+						else
+						{
+							sprintf(atr_command, ATR_PARSER " '%s'", atr);
+							if (system(atr_command))
+								perror(atr_command);
+						}
+					}
+
+					fprintf(out, "\n");
 				}
 			}
 
@@ -934,30 +4109,78 @@ get_readers:
 			}
 		} /* for */
 
+		/* analyses of the events not reported */
+		analysis_discard(readers_data, nbReaders);
+
+		if (pipeline)
+		{
+			report_add(out, NULL);
+			out = stdout;
+			report_flush(false);
+		}
+
 		if (Options.only_list_cards)
 			break;
 
-		printf("%sInsert or remove a card or a reader...%s ", red, color_end);
-		fflush(stdout);
+		/* the prompt is printed once all the reports are printed */
+		if (NULL == Reports)
+			prompt_start();
 
-		spin_start();
+		/* wait for the next events and for the end of the analyses
+		 * of the pending reports. Without the spinner thread the exit
+		 * and the statistics are checked at each poll. */
+		do
+		{
+			DWORD timeout = Options.debounce ?
+				debounce_timeout(readers_data, nbReaders) : TIMEOUT;
 
-		rv = SCardGetStatusChange(hContext, TIMEOUT, rgReaderStates_t,
-			nbReaders);
+			if (Reports && timeout > REPORT_POLL_MS)
+				timeout = REPORT_POLL_MS;
 
-		if (rv != SCARD_S_SUCCESS)
+			rv = SCardGetStatusChange(hContext, timeout, rgReaderStates_t,
+				nbReaders);
+		}
+		while (SCARD_E_TIMEOUT == rv && Reports && ! report_ready()
+			&& ! should_exit() && ! stats_due() && ! (Options.debounce
+				&& 0 == debounce_timeout(readers_data, nbReaders)));
+
+		/* interrupted while waiting without the spinner thread, or
+		 * SCardCancel() from the spinner thread between two polls */
+		if (should_exit())
+			rv = SCARD_E_CANCELLED;
+
+		/* end of a debounce window */
+		if (SCARD_E_TIMEOUT == rv && Options.debounce
+			&& debounce_timeout(readers_data, nbReaders) != TIMEOUT)
+			rv = SCARD_S_SUCCESS;
+
+		/* woken up by the spinner thread to print the statistics */
+		rv = stats_wakeup(rv, rgReaderStates_t, nbReaders);
+
+		if (Options.debounce && SCARD_S_SUCCESS == rv)
+			rv = debounce(hContext, rgReaderStates_t, readers_data, nbReaders);
+
+		if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
 		{
 			/* something bad happened. We need to exit */
 			Interrupted = true;
 		}
 
-		spin_stop();
-		printf("\n");
+		if (stats_due())
+		{
+			prompt_end();
+			print_stats();
+		}
 
 		if (Options.debug)
+		{
+			prompt_end();
 			displayChangedStatus(rgReaderStates_t, nbReaders);
+		}
 	} /* while */
 
+	prompt_end();
+
 	/* A reader disappeared */
 	if (SCARD_E_UNKNOWN_READER == rv)
 		goto get_readers;
@@ -966,8 +4189,23 @@ get_readers:
 	test_rv("SCardGetStatusChange", rv, end);
 
 end:
+	prompt_end();
+
+	/* do not wait for the analyses not yet done if interrupted */
+	report_flush(! should_exit());
+	report_discard();
+
+	if (Options.stats)
+		print_stats();
+
 	if (!pthread_equal(spin_pthread, pthread_self()))
 	{
+		/* the spinner thread may be waiting for the next spin_start() */
+		pthread_mutex_lock(&spinner_mutex);
+		Spin_exit = true;
+		pthread_cond_signal(&spinner_cond);
+		pthread_mutex_unlock(&spinner_mutex);
+
 		pthread_join(spin_pthread, NULL);
 		pthread_mutex_destroy(&spinner_mutex);
 		pthread_cond_destroy(&spinner_cond);
@@ -983,6 +4221,16 @@ end2:
 		free(readers);
 	if (NULL != rgReaderStates_t)
 		free(rgReaderStates_t);
+	if (NULL != readers_data)
+	{
+		analysis_discard(readers_data, nbReaders);
+		free(readers_data);
+	}
+	analysis_stop();
+	free_filters();
+	free_reader_caps();
+	free_stats();
+	capture_close();
 
 	return ret_val;
 }